@@ -0,0 +1,205 @@
+/*
+ bench: micro benchmarks for the FAT32 API
+ Usage: bench [scratch_image]
+ Every scenario formats a fresh scratch image (default ./bench_scratch.img) and the
+ results are printed to stdout as one JSON document, so two runs can be diffed.
+*/
+#include "fat16_32.h"
+#include "fat32api.h"
+#include "utils32.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_VOLUME_SIZE (512ULL << 20)
+#define BENCH_FILE_SIZE (4 << 20)
+#define BENCH_RANDOM_OPS 256
+#define BENCH_LOOKUP_REPS 200
+#define BENCH_META_OPS 200
+#define BENCH_ALLOC_REPS 20
+
+static const char * scratch;
+static bool firstResult = true;
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/// format a fresh scratch volume and mount it
+static void fresh_volume(unsigned int secPerClus) {
+    formatParam param;
+    memset(&param, 0, sizeof(param));
+    param.size = BENCH_VOLUME_SIZE;
+    param.secPerClus = secPerClus;
+    _OS_finalization();
+    if(OS_format(scratch, &param) != 0) {
+        fprintf(stderr, "cannot format %s\n", scratch);
+        exit(1);
+    }
+    _OS_initialization();
+}
+
+/// print one result object: @name, then the "key": value pairs @fmt formats from the arguments
+__attribute__((format(printf, 2, 3)))
+static void result(const char * name, const char * fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    printf("%s    {\"bench\": \"%s\", ", firstResult ? "" : ",\n", name);
+    vprintf(fmt, args);
+    printf("}");
+    va_end(args);
+    firstResult = false;
+}
+
+static void bench_data(unsigned int chunk) {
+    fresh_volume(8);
+    OS_creat("/seq.bin");
+    int fd = OS_open("/seq.bin");
+    unsigned char * buf = malloc(chunk);
+    memset(buf, 0xA5, chunk);
+    int off;
+
+    // writes may stay in memory, so the fsync that puts them on the device is timed too
+    double t0 = now();
+    for(off = 0; off < BENCH_FILE_SIZE; off += chunk) OS_write(fd, buf, chunk, off);
+    OS_fsync(fd);
+    double t = now() - t0;
+    result("seq_write", "\"chunk\": %u, \"bytes\": %d, \"seconds\": %.6f, \"MBps\": %.3f",
+           chunk, BENCH_FILE_SIZE, t, BENCH_FILE_SIZE / t / 1e6);
+
+    t0 = now();
+    for(off = 0; off < BENCH_FILE_SIZE; off += chunk) OS_read(fd, buf, chunk, off);
+    t = now() - t0;
+    result("seq_read", "\"chunk\": %u, \"bytes\": %d, \"seconds\": %.6f, \"MBps\": %.3f",
+           chunk, BENCH_FILE_SIZE, t, BENCH_FILE_SIZE / t / 1e6);
+
+    int numChunks = BENCH_FILE_SIZE / chunk;
+    int ops = numChunks < BENCH_RANDOM_OPS ? numChunks : BENCH_RANDOM_OPS;
+    int i;
+    srand(chunk);
+    t0 = now();
+    for(i = 0; i < ops; i++) OS_read(fd, buf, chunk, (rand() % numChunks) * chunk);
+    t = now() - t0;
+    result("rand_read", "\"chunk\": %u, \"ops\": %d, \"seconds\": %.6f, \"MBps\": %.3f",
+           chunk, ops, t, (double)ops * chunk / t / 1e6);
+
+    t0 = now();
+    for(i = 0; i < ops; i++) OS_write(fd, buf, chunk, (rand() % numChunks) * chunk);
+    OS_fsync(fd);
+    t = now() - t0;
+    result("rand_write", "\"chunk\": %u, \"ops\": %d, \"seconds\": %.6f, \"MBps\": %.3f",
+           chunk, ops, t, (double)ops * chunk / t / 1e6);
+
+    OS_close(fd);
+    free(buf);
+}
+
+/// average latency of resolving @path, in microseconds
+static double lookup_us(const char * path) {
+    int i;
+    double t0 = now();
+    for(i = 0; i < BENCH_LOOKUP_REPS; i++) free(_OS_getEnt(path));
+    return (now() - t0) / BENCH_LOOKUP_REPS * 1e6;
+}
+
+static void bench_lookup() {
+    char path[256] = "";
+    int depth;
+    fresh_volume(8);
+    for(depth = 1; depth <= 8; depth++) {
+        strcat(path, "/dir");
+        OS_mkdir(path);
+        result("getEnt_depth", "\"depth\": %d, \"usec\": %.3f", depth, lookup_us(path));
+    }
+
+    int widths[] = {16, 256, 1024};
+    int w, created = 0;
+    fresh_volume(8);
+    OS_mkdir("/wide");
+    for(w = 0; w < 3; w++) {
+        for( ; created < widths[w]; created++) {
+            snprintf(path, sizeof(path), "/wide/f%d", created);
+            OS_creat(path);
+        }
+        double hit = lookup_us(path);
+        double miss = lookup_us("/wide/missing");
+        result("getEnt_width", "\"width\": %d, \"hit_usec\": %.3f, \"miss_usec\": %.3f",
+               widths[w], hit, miss);
+    }
+}
+
+static void bench_metadata() {
+    char path[64];
+    int i;
+    fresh_volume(8);
+    OS_mkdir("/m");
+
+    double t0 = now();
+    for(i = 0; i < BENCH_META_OPS; i++) {
+        snprintf(path, sizeof(path), "/m/f%d", i);
+        OS_creat(path);
+    }
+    double t = now() - t0;
+    result("creat", "\"ops\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f",
+           BENCH_META_OPS, t, BENCH_META_OPS / t);
+
+    t0 = now();
+    for(i = 0; i < BENCH_META_OPS; i++) {
+        snprintf(path, sizeof(path), "/m/d%d", i);
+        OS_mkdir(path);
+    }
+    t = now() - t0;
+    result("mkdir", "\"ops\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f",
+           BENCH_META_OPS, t, BENCH_META_OPS / t);
+
+    t0 = now();
+    for(i = 0; i < BENCH_META_OPS; i++) {
+        snprintf(path, sizeof(path), "/m/f%d", i);
+        OS_rm(path);
+    }
+    t = now() - t0;
+    result("rm", "\"ops\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f",
+           BENCH_META_OPS, t, BENCH_META_OPS / t);
+}
+
+static void bench_alloc() {
+    int pct[] = {0, 25, 50, 75, 95};
+    int p;
+    for(p = 0; p < 5; p++) {
+        fresh_volume(8);
+        // mark the front of the volume as used, the root dir keeps cluster 2
+        uint32_t used = (uint64_t)(_status.totalClus - 3) * pct[p] / 100;
+        if(used > 0) _setFATchain(3, used);
+        int i;
+        double t0 = now();
+        for(i = 0; i < BENCH_ALLOC_REPS; i++) _findFirstEmptyClus();
+        double single = (now() - t0) / BENCH_ALLOC_REPS * 1e6;
+        t0 = now();
+        for(i = 0; i < BENCH_ALLOC_REPS; i++) _findFreeRun(256);
+        double run = (now() - t0) / BENCH_ALLOC_REPS * 1e6;
+        result("alloc", "\"full_pct\": %d, \"first_empty_usec\": %.3f, \"free_run_usec\": %.3f",
+               pct[p], single, run);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    scratch = argc > 1 ? argv[1] : "bench_scratch.img";
+    setenv("FAT_FS_PATH", scratch, 1);
+    printf("{\n  \"volume_bytes\": %llu,\n  \"results\": [\n", BENCH_VOLUME_SIZE);
+    unsigned int chunks[] = {512, 4096, 65536, 1 << 20};
+    int i;
+    for(i = 0; i < 4; i++) bench_data(chunks[i]);
+    bench_lookup();
+    bench_metadata();
+    bench_alloc();
+    printf("\n  ]\n}\n");
+    _OS_finalization();
+    unlink(scratch);
+    return 0;
+}
@@ -0,0 +1,402 @@
+/*
+ * Image builder for the FAT32 API
+ *
+ * OS_build_image(const char *host_dir): fill the (empty) volume with a copy of the
+ *   host directory tree @host_dir
+ *
+ * Instead of replaying OS_mkdir/OS_creat/OS_write for every node, the whole tree is
+ * scanned and laid out first: every directory gets its entries in contiguous clusters
+ * and every file a contiguous run, all inside one free run of the volume. The data
+ * region is then written front to back in one stream, followed by the FAT.
+ */
+
+#define _GNU_SOURCE
+#include "fat16_32.h"
+#include "fat32api.h"
+#include "utils32.h"
+#include "stats32.h"
+#include "journal32.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/// a file or dir of the host tree, with its planned place on the volume
+typedef struct {
+    char * hostPath;
+    uint8_t name[11];
+    bool isDir;
+    uint32_t size;       // file size in bytes, 0 for dirs
+    int parent;          // index of the parent node, -1 for the root
+    int * children;      // indices of the child nodes
+    int numChildren;
+    uint32_t numClus;    // clusters planned for this node
+    uint32_t startClus;  // first planned cluster
+} buildNode;
+
+typedef struct {
+    buildNode * nodes;
+    int numNodes;
+    int volNodes;
+    uint32_t totalClus; // clusters needed by the whole plan, root excluded
+} buildPlan;
+
+/// staging buffer that turns the planned layout into large sequential writes
+typedef struct {
+    unsigned char * buf;
+    size_t len;
+    size_t cap;
+    off_t pos; // device position of buf[0]
+    bool failed;
+} buildStream;
+
+static void _stream_flush(buildStream * st) {
+    if(st->len == 0) return;
+    if(_dev_write(st->buf, st->len, st->pos) != st->len) st->failed = true;
+    st->pos += st->len;
+    st->len = 0;
+}
+
+static void _stream_put(buildStream * st, const void * data, size_t n) {
+    while(n > 0) {
+        size_t room = st->cap - st->len;
+        size_t k = n < room ? n : room;
+        if(data) memcpy(st->buf + st->len, data, k);
+        else memset(st->buf + st->len, 0, k);
+        if(data) data = (const char *)data + k;
+        st->len += k;
+        n -= k;
+        if(st->len == st->cap) _stream_flush(st);
+    }
+}
+
+static int _cmp_name(const void * a, const void * b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/// free the nodes of @plan from index @from on and forget them
+static void _drop_nodes(buildPlan * plan, int from) {
+    int i;
+    for(i = from; i < plan->numNodes; i++) {
+        free(plan->nodes[i].hostPath);
+        free(plan->nodes[i].children);
+    }
+    plan->numNodes = from;
+}
+
+/**
+ * add the host path @hostPath as a node, and everything below it if it is a dir
+ * @return index of the new node, -1 if the path cannot be read, -3 if a name is not
+ * a valid 8.3 name or clashes with a sibling, -4 if a file is too large. On failure
+ * no node is left behind
+ */
+static int _scan_host(buildPlan * plan, const char * hostPath, const char * name, int parent) {
+    struct stat st;
+    // links below @host_dir are not followed, so a link to an ancestor cannot loop
+    if((parent < 0 ? stat(hostPath, &st) : lstat(hostPath, &st)) != 0) return -1;
+    if(plan->numNodes == plan->volNodes) {
+        plan->volNodes = plan->volNodes ? 2 * plan->volNodes : 64;
+        plan->nodes = realloc(plan->nodes, plan->volNodes * sizeof(buildNode));
+    }
+    int self = plan->numNodes++;
+    buildNode * node = &plan->nodes[self];
+    memset(node, 0, sizeof(buildNode));
+    node->hostPath = strdup(hostPath);
+    node->parent = parent;
+    node->isDir = S_ISDIR(st.st_mode);
+    if(parent >= 0) {
+        char tmp[13];
+        bool bad = strlen(name) > 12;
+        if(!bad) {
+            strcpy(tmp, name);
+            bad = flnm2FAT(tmp, node->name) || verify(node->name, tmp);
+        }
+        if(bad) {
+            _drop_nodes(plan, self);
+            return -3;
+        }
+    }
+    if(!node->isDir) {
+        if(st.st_size > 0xFFFFFFFFLL) {
+            _drop_nodes(plan, self);
+            return -4;
+        }
+        node->size = st.st_size;
+        return self;
+    }
+
+    DIR * d = opendir(hostPath);
+    if(d == NULL) {
+        _drop_nodes(plan, self);
+        return -1;
+    }
+    int volNames = 16, numNames = 0;
+    char ** names = malloc(volNames * sizeof(char *));
+    struct dirent * de;
+    while((de = readdir(d)) != NULL) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if(numNames == volNames) {
+            volNames *= 2;
+            names = realloc(names, volNames * sizeof(char *));
+        }
+        names[numNames++] = strdup(de->d_name);
+    }
+    closedir(d);
+    qsort(names, numNames, sizeof(char *), _cmp_name);
+
+    int err = 0;
+    int * children = malloc((numNames + 1) * sizeof(int));
+    int numChildren = 0;
+    int i;
+    for(i = 0; i < numNames; i++) {
+        if(err) {free(names[i]); continue;}
+        size_t len = strlen(hostPath) + strlen(names[i]) + 2;
+        char * childPath = malloc(len);
+        snprintf(childPath, len, "%s/%s", hostPath, names[i]);
+        struct stat cst;
+        // only regular files and dirs are copied, symbolic links are skipped
+        if(lstat(childPath, &cst) == 0 && (S_ISREG(cst.st_mode) || S_ISDIR(cst.st_mode))) {
+            int child = _scan_host(plan, childPath, names[i], self);
+            if(child < 0) {
+                err = child;
+            } else {
+                int k;
+                for(k = 0; k < numChildren; k++)
+                    if(memcmp(plan->nodes[children[k]].name, plan->nodes[child].name, 11) == 0) err = -3;
+                children[numChildren++] = child;
+            }
+        }
+        free(childPath);
+        free(names[i]);
+    }
+    free(names);
+    // plan->nodes may have moved during the recursion
+    plan->nodes[self].children = children;
+    plan->nodes[self].numChildren = numChildren;
+    if(err) _drop_nodes(plan, self);
+    return err ? err : self;
+}
+
+/// order node indices by planned cluster, @plan is the buildPlan they belong to
+static int _cmp_start(const void * a, const void * b, void * plan) {
+    uint32_t ca = ((const buildPlan *)plan)->nodes[*(const int *)a].startClus;
+    uint32_t cb = ((const buildPlan *)plan)->nodes[*(const int *)b].startClus;
+    return ca < cb ? -1 : ca > cb;
+}
+
+/// number of clusters of the node @i, a dir keeps one free slot as end marker
+static uint32_t _node_clusters(const buildPlan * plan, int i) {
+    const buildNode * node = &plan->nodes[i];
+    uint64_t bytes;
+    if(node->isDir) {
+        bytes = (uint64_t)(node->numChildren + 1 + (node->parent >= 0 ? 2 : 0)) * sizeof(dirEnt);
+    } else {
+        bytes = node->size;
+    }
+    // an empty file owns no cluster, its entry has cluster 0
+    return (bytes + _status.BytesPerCluster - 1) / _status.BytesPerCluster;
+}
+
+/// place node @i at @*cursor: its own clusters, then its files, then its sub dirs
+static void _place_tree(buildPlan * plan, int i, uint32_t * cursor) {
+    buildNode * node = &plan->nodes[i];
+    node->startClus = node->numClus > 0 ? *cursor : 0;
+    *cursor += node->numClus;
+    int k;
+    for(k = 0; k < node->numChildren; k++)
+        if(!plan->nodes[node->children[k]].isDir) _place_tree(plan, node->children[k], cursor);
+    for(k = 0; k < node->numChildren; k++)
+        if(plan->nodes[node->children[k]].isDir) _place_tree(plan, node->children[k], cursor);
+}
+
+/// the dirEnt describing node @i in its parent's list
+static void _node_dirEnt(const buildPlan * plan, int i, dirEnt * ent) {
+    const buildNode * node = &plan->nodes[i];
+    memset(ent, 0, sizeof(dirEnt));
+    memcpy(ent->dir_name, node->name, 11);
+    ent->dir_attr = node->isDir ? 0x10 : 0x20;
+    ent->dir_fstClusLO = node->startClus & 0xFFFF;
+    ent->dir_fstClusHI = node->startClus >> 16;
+    ent->dir_fileSize = node->size;
+}
+
+/// write the list of dir node @i to the stream
+static void _emit_dir(const buildPlan * plan, int i, buildStream * st) {
+    const buildNode * node = &plan->nodes[i];
+    dirEnt ent;
+    uint64_t written = 0;
+    if(node->parent >= 0) {
+        _node_dirEnt(plan, i, &ent);
+        memset(ent.dir_name, 0x20, 11);
+        ent.dir_name[0] = '.';
+        _stream_put(st, &ent, sizeof(dirEnt));
+        if(plan->nodes[node->parent].parent >= 0) {
+            _node_dirEnt(plan, node->parent, &ent);
+        } else {
+            memset(&ent, 0, sizeof(dirEnt)); // '..' of a top level dir points to cluster 0
+            ent.dir_attr = 0x10;
+        }
+        memset(ent.dir_name, 0x20, 11);
+        ent.dir_name[0] = '.';
+        ent.dir_name[1] = '.';
+        _stream_put(st, &ent, sizeof(dirEnt));
+        written += 2 * sizeof(dirEnt);
+    }
+    int k;
+    for(k = 0; k < node->numChildren; k++) {
+        _node_dirEnt(plan, node->children[k], &ent);
+        _stream_put(st, &ent, sizeof(dirEnt));
+        written += sizeof(dirEnt);
+    }
+    _stream_put(st, NULL, (uint64_t)node->numClus * _status.BytesPerCluster - written);
+}
+
+/// write the content of file node @i to the stream, padded to whole clusters
+static void _emit_file(const buildPlan * plan, int i, buildStream * st) {
+    const buildNode * node = &plan->nodes[i];
+    uint64_t remaining = node->size;
+    int fd = open(node->hostPath, O_RDONLY);
+    if(fd < 0) {
+        st->failed = true;
+    } else {
+        while(remaining > 0 && !st->failed) {
+            if(st->len == st->cap) _stream_flush(st);
+            size_t room = st->cap - st->len;
+            ssize_t r = read(fd, st->buf + st->len, remaining < room ? remaining : room);
+            if(r <= 0) {
+                st->failed = true;
+                break;
+            }
+            st->len += r;
+            remaining -= r;
+        }
+        close(fd);
+    }
+    _stream_put(st, NULL, (uint64_t)node->numClus * _status.BytesPerCluster - (node->size - remaining));
+}
+
+/**
+ * write the FAT entries of the planned run @start .. @start + @count - 1 from @fat,
+ * one read-modify-write for the sectors at both ends and plain writes in between
+ */
+static void _write_fat_run(const uint32_t * fat, uint32_t start, uint32_t count) {
+    const uint32_t entPerSec = _status.BytesPerSec / SIZE_FAT_ENTRY;
+    uint32_t firstSec = start / entPerSec, lastSec = (start + count - 1) / entPerSec;
+    size_t len = (size_t)(lastSec - firstSec + 1) * _status.BytesPerSec;
+    uint32_t * buf = malloc(len);
+    int i;
+    for(i = 0; i < _status.numFAT; i++) {
+        off_t pos = (off_t)(_status.startFATSec + (uint32_t)i * _status.FATSz + firstSec) * _status.BytesPerSec;
+        _dev_read(buf, _status.BytesPerSec, pos);
+        if(lastSec != firstSec)
+            _dev_read(buf + (len - _status.BytesPerSec) / SIZE_FAT_ENTRY, _status.BytesPerSec,
+                      pos + len - _status.BytesPerSec);
+        uint32_t k;
+        for(k = 0; k < count; k++) {
+            uint32_t slot = start + k - firstSec * entPerSec;
+            if(i == 0) _stat_count_fat_change(buf[slot] & 0x0FFFFFFF, fat[k]);
+            buf[slot] = (buf[slot] & 0xF0000000) + fat[k];
+        }
+        _dev_write(buf, len, pos);
+    }
+    free(buf);
+}
+
+/** copy the host directory tree @host_dir into the root of the volume
+ * the root must not contain any entries yet
+ * @return number of files and dirs created, -1 if @host_dir cannot be read, -2 if the
+ * root directory is not empty, -3 if a name is not a valid 8.3 name or two names clash,
+ * -4 if the volume has not enough contiguous free space, -5 if writing failed
+ */
+int OS_build_image(const char *host_dir)
+{
+    STAT_TIMED(OS_OP_BUILD_IMAGE);
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    int numRoot = 0;
+    free(_read_dir_clus(_status.idxRootDirClus, &numRoot));
+    if(numRoot > 0) return -2;
+
+    buildPlan plan;
+    memset(&plan, 0, sizeof(plan));
+    int excode = _scan_host(&plan, host_dir, "", -1);
+    if(excode >= 0 && !plan.nodes[0].isDir) excode = -1;
+    int i;
+    if(excode >= 0) {
+        // the root keeps its existing cluster and only gets the extra ones planned
+        for(i = 0; i < plan.numNodes; i++) {
+            plan.nodes[i].numClus = _node_clusters(&plan, i);
+            plan.totalClus += plan.nodes[i].numClus;
+        }
+        plan.nodes[0].numClus--;
+        plan.totalClus--;
+    }
+    uint32_t runStart = 0;
+    if(excode >= 0 && plan.totalClus > 0) {
+        runStart = _findFreeRun(plan.totalClus);
+        if(runStart == 0) excode = -4;
+    }
+    if(excode >= 0) {
+        uint32_t cursor = runStart;
+        _place_tree(&plan, 0, &cursor);
+
+        // every node is one contiguous chain inside the run
+        uint32_t * fat = malloc((plan.totalClus + 1) * sizeof(uint32_t));
+        for(i = 0; i < plan.numNodes; i++) {
+            uint32_t k;
+            for(k = 0; k < plan.nodes[i].numClus; k++)
+                fat[plan.nodes[i].startClus - runStart + k] =
+                    k + 1 == plan.nodes[i].numClus ? 0x0FFFFFFF : plan.nodes[i].startClus + k + 1;
+        }
+
+        // the root list starts in its existing cluster and continues at the head of the run
+        uint32_t rootExtra = plan.nodes[0].numClus;
+        size_t rootBytes = (size_t)(rootExtra + 1) * _status.BytesPerCluster;
+        buildStream rst = {malloc(rootBytes + 1), 0, rootBytes + 1, 0, false};
+        plan.nodes[0].numClus = rootExtra + 1;
+        _emit_dir(&plan, 0, &rst);
+        plan.nodes[0].numClus = rootExtra;
+
+        size_t cap = COPY_CHUNK_SIZE - COPY_CHUNK_SIZE % _status.BytesPerCluster;
+        buildStream st = {malloc(cap), 0, cap, _clusterPos(runStart), false};
+        _stream_put(&st, rst.buf + _status.BytesPerCluster, rootBytes - _status.BytesPerCluster);
+        // the stream must follow the planned cluster order, not the scan order
+        int * order = malloc(plan.numNodes * sizeof(int));
+        for(i = 0; i < plan.numNodes; i++) order[i] = i;
+        qsort_r(order + 1, plan.numNodes - 1, sizeof(int), _cmp_start, &plan);
+        for(i = 1; i < plan.numNodes; i++) {
+            if(plan.nodes[order[i]].isDir) _emit_dir(&plan, order[i], &st);
+            else _emit_file(&plan, order[i], &st);
+        }
+        free(order);
+        _stream_flush(&st);
+        free(st.buf);
+        if(st.failed) {
+            excode = -5;
+        } else {
+            // data first, then the chains, and the root list last makes the tree visible;
+            // with FAT_FS_JOURNAL the chains and the root list are one logged update
+            JOURNAL_OP();
+            if(plan.totalClus > 0) _write_fat_run(fat, runStart, plan.totalClus);
+            if(rootExtra > 0) {
+                // clusters the empty root still had past its first one are given back
+                uint32_t oldTail = _getFATvalue(_status.idxRootDirClus);
+                _setFATvalue(_status.idxRootDirClus, runStart);
+                if(oldTail >= 2 && oldTail < _status.totalClus) _remove_link(oldTail);
+            }
+            if(_dev_write(rst.buf, _status.BytesPerCluster, _clusterPos(_status.idxRootDirClus))
+               != _status.BytesPerCluster)
+                excode = -5;
+        }
+        free(rst.buf);
+        free(fat);
+    }
+    int numNodes = plan.numNodes;
+    _drop_nodes(&plan, 0);
+    free(plan.nodes);
+    return excode >= 0 ? numNodes - 1 : excode;
+}
@@ -0,0 +1,145 @@
+/*
+ crash32: crash and replay checks of the intent log of the FAT32 API
+ Usage: crash32 [scratch_image]
+ Every case formats a fresh scratch image (default ./crash_scratch.img), runs its calls in
+ a child mounted with FAT_FS_JOURNAL that dies with _exit (no unmount, no atexit), then
+ mounts the image again, which replays the log. The files must read back as one of the
+ states the calls went through and OS_fsck must find nothing to repair. A last case
+ formats the image again before the mount: the log of the old volume must be left alone.
+*/
+#include "fat16_32.h"
+#include "fat32api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define CRASH_VOLUME_SIZE (64ULL << 20)
+#define CRASH_FILE_SIZE 20000
+
+static const char * scratch;
+static char logPath[4096];
+static unsigned char buf[CRASH_FILE_SIZE];
+
+/// write @size bytes of @fill to the existing file @path and close it
+static void put(const char * path, int fill, int size) {
+    int fd = OS_open(path);
+    memset(buf, fill, size);
+    OS_write(fd, buf, size, 0);
+    OS_close(fd);
+}
+
+/// 1 if @path is missing, 0 if it has @size bytes of @fill, -1 otherwise
+static int check(const char * path, int fill, int size) {
+    int fd = OS_open(path);
+    if(fd < 0) return 1;
+    memset(buf, 0, sizeof(buf));
+    int n = OS_read(fd, buf, sizeof(buf), 0);
+    OS_close(fd);
+    int i;
+    for(i = 0; i < n && buf[i] == fill; i++) ;
+    return n == size && i == n ? 0 : -1;
+}
+
+/// (a) a committed entry rewritten by unlogged writes: OS_creat, OS_sync, write and close
+static void case_rewrite() {
+    OS_creat("/B.TXT");
+    OS_sync();
+    put("/B.TXT", 'b', CRASH_FILE_SIZE);
+}
+
+static int check_rewrite() {
+    // the close put the size on the device, a replay must not bring back the empty entry
+    return check("/B.TXT", 'b', CRASH_FILE_SIZE) == 0;
+}
+
+/// (b) clusters freed by an uncommitted OS_rm taken by unlogged writes of another file
+static void case_reuse() {
+    OS_creat("/A.TXT");
+    put("/A.TXT", 'a', CRASH_FILE_SIZE);
+    OS_sync();
+    OS_rm("/A.TXT");
+    OS_creat("/C.TXT");
+    put("/C.TXT", 'c', CRASH_FILE_SIZE);
+}
+
+static int check_reuse() {
+    // A may come back only with its own data, C may be lost but not half written
+    return check("/A.TXT", 'a', CRASH_FILE_SIZE) >= 0 && check("/C.TXT", 'c', CRASH_FILE_SIZE) >= 0;
+}
+
+/// run @calls in a child that crashes, replay, then @verify the files and fsck the volume
+static int run(const char * name, void (*calls)(), int (*verify)()) {
+    formatParam param;
+    memset(&param, 0, sizeof(param));
+    param.size = CRASH_VOLUME_SIZE;
+    unlink(logPath);
+    if(OS_format(scratch, &param) != 0) {
+        fprintf(stderr, "cannot format %s\n", scratch);
+        exit(1);
+    }
+    setenv("FAT_FS_JOURNAL", logPath, 1);
+    pid_t pid = fork();
+    if(pid == 0) {
+        calls();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+
+    int ok = verify();
+    _OS_finalization();
+    unsetenv("FAT_FS_JOURNAL");
+    fsckParam fp = {1, false, 1};
+    fsckReport report;
+    int clean = OS_fsck(&fp, &report) == 0;
+    _OS_finalization();
+    printf("%s: files %s, fsck %s (cross-linked %lu, bad chains %lu, lost clusters %lu, size mismatches %lu)\n",
+           name, ok ? "ok" : "WRONG", clean ? "clean" : "DIRTY", report.crossLinked, report.badChains,
+           report.lostClusters, report.sizeMismatch);
+    return ok && clean;
+}
+
+/// (c) a committed OS_mkdir in the log of a volume that is formatted again before the mount
+static int run_foreign() {
+    formatParam param;
+    memset(&param, 0, sizeof(param));
+    param.size = CRASH_VOLUME_SIZE;
+    param.volID = 1;
+    unlink(logPath);
+    if(OS_format(scratch, &param) != 0) exit(1);
+    setenv("FAT_FS_JOURNAL", logPath, 1);
+    pid_t pid = fork();
+    if(pid == 0) {
+        OS_mkdir("/D");
+        OS_sync();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    param.volID = 2;
+    if(OS_format(scratch, &param) != 0) exit(1);
+
+    struct stat sb;
+    bool replayed = OS_cd("/D") == 1;
+    _OS_finalization();
+    unsetenv("FAT_FS_JOURNAL");
+    bool kept = stat(logPath, &sb) == 0 && sb.st_size > 0;
+    printf("log of another volume: %s, log %s\n", replayed ? "REPLAYED" : "not replayed", kept ? "kept" : "LOST");
+    return !replayed && kept;
+}
+
+int main(int argc, char *argv[])
+{
+    scratch = argc > 1 ? argv[1] : "crash_scratch.img";
+    snprintf(logPath, sizeof(logPath), "%s.jnl", scratch);
+    setenv("FAT_FS_PATH", scratch, 1);
+    int ok = run("rewrite after sync", case_rewrite, check_rewrite);
+    ok &= run("reuse of freed clusters", case_reuse, check_reuse);
+    ok &= run_foreign();
+    unlink(scratch);
+    unlink(logPath);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,179 @@
+/*
+ * Defragmenter for the FAT32 API
+ *
+ * OS_defrag(const defragParam *param, defragReport *report): report the fragmentation of
+ *   every file and optionally move fragmented files to contiguous runs
+ *
+ * A file is moved in an order that keeps the volume consistent at every step:
+ *  1. its data is copied to a free run, which is still free in the FAT
+ *  2. the run is linked into a chain of its own
+ *  3. the directory entry is pointed at the new chain
+ *  4. the old chain is freed, and discarded on the device once 3 is durable
+ * A crash after 2 leaves lost clusters (found by OS_fsck), never a damaged file.
+ * Directories are reported but not moved: their "." and the ".." of every sub dir
+ * would have to follow.
+ */
+
+#include "fat16_32.h"
+#include "fat32api.h"
+#include "utils32.h"
+#include "stats32.h"
+#include "journal32.h"
+#include "dev32.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/// a file found by the walk
+typedef struct {
+    char * path;
+    dirEnt ent;
+    uint32_t parentClus;
+} defragFile;
+
+typedef struct {
+    pthread_mutex_t lock;
+    defragFile * files;
+    int num;
+    int vol;
+} defragList;
+
+static int _defrag_collect(const walkEnt * we, void * arg) {
+    defragList * list = arg;
+    if(we->ent->dir_attr & 0x10) return WALK_CONTINUE;
+    pthread_mutex_lock(&list->lock);
+    if(list->num == list->vol) {
+        list->vol = list->vol ? 2 * list->vol : 64;
+        list->files = realloc(list->files, list->vol * sizeof(defragFile));
+    }
+    defragFile * f = &list->files[list->num++];
+    f->path = strdup(we->path);
+    f->ent = *we->ent;
+    f->parentClus = we->parentClus;
+    pthread_mutex_unlock(&list->lock);
+    return WALK_CONTINUE;
+}
+
+/// sleep as long as needed to keep @done bytes since @start (ns) under @rate bytes per second
+static void _defrag_throttle(uint64_t rate, uint64_t start, uint64_t done) {
+    if(rate == 0) return;
+    uint64_t due = start + done * 1000000000ULL / rate;
+    uint64_t now = _stat_now();
+    if(due <= now) return;
+    struct timespec t = {(due - now) / 1000000000ULL, (due - now) % 1000000000ULL};
+    while(nanosleep(&t, &t) != 0) ;
+}
+
+/**
+ * move the chain @ext of file @f to the free run starting at @dst
+ * @return 0 if success, 1 if failure (the file stays on its old chain)
+ */
+static int _defrag_move(defragFile * f, const extent * ext, int numExt, uint32_t dst, uint32_t length,
+                        unsigned char * buf, const defragParam * param, uint64_t start, uint64_t * copied) {
+    const uint32_t clusPerChunk = COPY_CHUNK_SIZE / _status.BytesPerCluster;
+    uint32_t to = dst;
+    int i;
+    // 1. copy, the target run is still free so a crash here loses nothing
+    for(i = 0; i < numExt; i++) {
+        uint32_t k;
+        for(k = 0; k < ext[i].count; k += clusPerChunk) {
+            uint32_t c = ext[i].count - k < clusPerChunk ? ext[i].count - k : clusPerChunk;
+            size_t len = (size_t)c * _status.BytesPerCluster;
+            if(_dev_read(buf, len, _clusterPos(ext[i].start + k)) != len) return 1;
+            if(_dev_write(buf, len, _clusterPos(to)) != len) return 1;
+            to += c;
+            *copied += len;
+            _defrag_throttle(param->maxBytesPerSec, start, *copied);
+        }
+    }
+    // the data must be on the device before a FAT that can be written back links it
+    if(_dev_flush() != 0) return 1;
+    // 2. link the new chain
+    if(_setFATchain(dst, length) != 0) return 1;
+    // and the chain before the entry that points at it
+    if(_dev_flush() != 0) {
+        _remove_link(dst);
+        return 1;
+    }
+    // 3. point the entry at it
+    uint32_t old = f->ent.dir_fstClusLO + ((uint32_t)f->ent.dir_fstClusHI << 16);
+    f->ent.dir_fstClusLO = dst & 0xFFFF;
+    f->ent.dir_fstClusHI = dst >> 16;
+    if(_update_dirEnt(f->parentClus, &f->ent) != 0) {
+        _remove_link(dst);
+        return 1;
+    }
+    // 4. free the old chain; the device may drop its blocks once the new entry is durable,
+    // committed if the mount is journaled and flushed to the device in any case
+    if(_journal_sync() == 0 && _dev_flush() == 0) {
+        for(i = 0; i < numExt; i++)
+            _dev_discard(_clusterPos(ext[i].start), (off_t)ext[i].count * _status.BytesPerCluster);
+    }
+    _remove_link(old);
+    return 0;
+}
+
+/** report the fragmentation of all files of the volume, and move every file made of at
+ * least @param->minExtents runs to a contiguous free run if @param->relocate is set.
+ * Open files and files for which no free run is large enough are skipped.
+ * @param->maxBytesPerSec limits the copy rate so the defragmenter can run between
+ * other requests.
+ * @return 0 if success, -1 if the tree could not be walked or files are to be moved on a
+ * read-only mount
+ */
+int OS_defrag(const defragParam *param, defragReport *report)
+{
+    STAT_TIMED(OS_OP_DEFRAG);
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    if(param->relocate && _status.readOnly) return -1;
+    memset(report, 0, sizeof(defragReport));
+    defragList list;
+    memset(&list, 0, sizeof(list));
+    pthread_mutex_init(&list.lock, NULL);
+    long walked = OS_walk("/", _defrag_collect, &list, 1);
+    pthread_mutex_destroy(&list.lock);
+    if(walked < 0) return -1;
+
+    unsigned int minExtents = param->minExtents < 2 ? 2 : param->minExtents;
+    unsigned char * buf = malloc(COPY_CHUNK_SIZE);
+    uint64_t start = _stat_now(), copied = 0;
+    int i;
+    for(i = 0; i < list.num; i++) {
+        defragFile * f = &list.files[i];
+        uint32_t clus = f->ent.dir_fstClusLO + ((uint32_t)f->ent.dir_fstClusHI << 16);
+        report->files++;
+        int numExt = 0;
+        extent * ext = clus ? _get_extents(clus, 0, &numExt) : NULL;
+        uint32_t length = 0;
+        int k;
+        for(k = 0; k < numExt; k++) length += ext[k].count;
+        report->extents += numExt;
+        report->clusters += length;
+        if(numExt > 1) report->fragmentedFiles++;
+
+        const char * action = "";
+        if(param->relocate && numExt >= minExtents) {
+            uint32_t dst = _open_find(clus) != NULL ? 0 : _findFreeRun(length);
+            if(dst != 0 && _defrag_move(f, ext, numExt, dst, length, buf, param, start, &copied) == 0) {
+                report->relocated++;
+                report->clustersMoved += length;
+                action = " moved";
+            } else {
+                report->skipped++;
+                action = " skipped";
+            }
+        }
+        if(param->logFd >= 0)
+            dprintf(param->logFd, "%s: %d runs, %u clusters, %.1f clusters per run%s\n", f->path, numExt,
+                    length, numExt ? (double)length / numExt : 0.0, action);
+        free(ext);
+        free(f->path);
+    }
+    report->avgRunLen = report->extents ? (double)report->clusters / report->extents : 0.0;
+    free(buf);
+    free(list.files);
+    return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ defrag32: report and reduce the fragmentation of a FAT32 image
+ Usage: defrag32 [-n] [-v] [-m runs] [-r MiB/s] image
+   -n  only report, move nothing
+   -v  one line per file
+   -m  move files made of at least this many runs (default 2)
+   -r  limit the copy rate
+*/
+#include "fat16_32.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+    defragParam param = {true, 2, 0, -1};
+    int opt;
+    while((opt = getopt(argc, argv, "nvm:r:")) != -1) {
+        switch(opt) {
+            case 'n': param.relocate = false; break;
+            case 'v': param.logFd = 1; break;
+            case 'm': param.minExtents = atoi(optarg); break;
+            case 'r': param.maxBytesPerSec = strtoull(optarg, NULL, 10) << 20; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n] [-v] [-m runs] [-r MiB/s] image\n", argv[0]);
+                return 2;
+        }
+    }
+    if(argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-n] [-v] [-m runs] [-r MiB/s] image\n", argv[0]);
+        return 2;
+    }
+    if(access(argv[optind], R_OK | (param.relocate ? W_OK : 0)) != 0) {
+        perror(argv[optind]);
+        return 2;
+    }
+    setenv("FAT_FS_PATH", argv[optind], 1);
+    defragReport report;
+    if(OS_defrag(&param, &report) < 0) {
+        fprintf(stderr, "cannot walk the directory tree\n");
+        return 2;
+    }
+    printf("%lu files, %lu fragmented, %lu runs over %lu clusters, %.2f clusters per run\n",
+           report.files, report.fragmentedFiles, report.extents, report.clusters, report.avgRunLen);
+    if(param.relocate)
+        printf("moved: %lu files (%lu clusters), skipped: %lu\n",
+               report.relocated, report.clustersMoved, report.skipped);
+    return 0;
+}
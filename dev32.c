@@ -0,0 +1,264 @@
+/*
+ * Block device backends for the FAT32 API
+ *
+ * Every access to the volume goes through the devBackend of the mount (_status.dev),
+ * chosen by FAT_FS_BACKEND:
+ *  - "file" (default): pread/pwrite on the image, as the library always did
+ *  - "ram": the image is read into memory at mount and served from there, for tests and
+ *    benchmarks that must not depend on the disk; changes are dropped at unmount
+ *  - "direct": O_DIRECT on the image or raw block device, for hosts that cache the
+ *    device themselves. Transfers that are not aligned to the logical block size go
+ *    through aligned bounce buffers, partial blocks are read, patched and written back
+ *    while no other write is running.
+ */
+
+#define _GNU_SOURCE
+#include "fat16_32.h"
+#include "fat32api.h"
+#include "dev32.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+// ---- file ----
+
+static int _file_open(const char * path, bool readOnly) {
+    _status.device_fd = open(path, readOnly ? O_RDONLY : O_RDWR, 0);
+    return _status.device_fd < 0 ? -1 : 0;
+}
+
+static ssize_t _file_read(void * buf, size_t n, off_t pos) {
+    return pread(_status.device_fd, buf, n, pos);
+}
+
+static ssize_t _file_write(const void * buf, size_t n, off_t pos) {
+    return pwrite(_status.device_fd, buf, n, pos);
+}
+
+static int _file_flush() {
+    return fsync(_status.device_fd);
+}
+
+static int _file_discard(off_t pos, off_t len) {
+    return fallocate(_status.device_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len);
+}
+
+static void _file_close() {
+    close(_status.device_fd);
+}
+
+const devBackend _devFile = {"file", _file_open, _file_read, _file_write, _file_flush, _file_discard,
+                             _file_close, true};
+
+// ---- ram ----
+
+static unsigned char * _ram = NULL;
+static off_t _ramSize = 0;
+
+static int _ram_open(const char * path, bool readOnly) {
+    (void)readOnly;
+    int fd = open(path, O_RDONLY);
+    struct stat sb;
+    if(fd < 0 || fstat(fd, &sb) != 0 || (_ram = malloc(sb.st_size)) == NULL) {
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    _ramSize = 0;
+    while(_ramSize < sb.st_size) {
+        ssize_t r = pread(fd, _ram + _ramSize, sb.st_size - _ramSize, _ramSize);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        _ramSize += r;
+    }
+    close(fd);
+    _status.device_fd = -1;
+    return 0;
+}
+
+static ssize_t _ram_read(void * buf, size_t n, off_t pos) {
+    if(pos >= _ramSize) return 0;
+    if((off_t)n > _ramSize - pos) n = _ramSize - pos;
+    memcpy(buf, _ram + pos, n);
+    return n;
+}
+
+static ssize_t _ram_write(const void * buf, size_t n, off_t pos) {
+    if(pos >= _ramSize) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if((off_t)n > _ramSize - pos) n = _ramSize - pos;
+    memcpy(_ram + pos, buf, n);
+    return n;
+}
+
+static int _ram_flush() {
+    return 0;
+}
+
+static int _ram_discard(off_t pos, off_t len) {
+    if(pos < _ramSize) memset(_ram + pos, 0, len < _ramSize - pos ? len : _ramSize - pos);
+    return 0;
+}
+
+static void _ram_close() {
+    free(_ram);
+    _ram = NULL;
+    _ramSize = 0;
+}
+
+const devBackend _devRam = {"ram", _ram_open, _ram_read, _ram_write, _ram_flush, _ram_discard,
+                            _ram_close, false};
+
+// ---- direct ----
+
+static size_t _blockSize = 4096;
+static pthread_mutex_t _poolLock = PTHREAD_MUTEX_INITIALIZER;
+// aligned writes share it, a read-modify-write of partial blocks holds it alone so it cannot
+// write back a block that changed after it was read
+static pthread_rwlock_t _rmwLock = PTHREAD_RWLOCK_INITIALIZER;
+static void * _pool[DIRECT_POOL_BUFS];
+static int _poolFree = 0;
+
+static void * _pool_get() {
+    void * p = NULL;
+    pthread_mutex_lock(&_poolLock);
+    if(_poolFree > 0) p = _pool[--_poolFree];
+    pthread_mutex_unlock(&_poolLock);
+    if(p == NULL && posix_memalign(&p, _blockSize, DIRECT_BUF_SIZE) != 0) p = NULL;
+    return p;
+}
+
+static void _pool_put(void * p) {
+    pthread_mutex_lock(&_poolLock);
+    if(_poolFree < DIRECT_POOL_BUFS) {
+        _pool[_poolFree++] = p;
+        p = NULL;
+    }
+    pthread_mutex_unlock(&_poolLock);
+    free(p);
+}
+
+static int _direct_open(const char * path, bool readOnly) {
+    _status.device_fd = open(path, (readOnly ? O_RDONLY : O_RDWR) | O_DIRECT, 0);
+    if(_status.device_fd < 0) return -1;
+    // a raw device tells its logical block size, 4096 suits the file systems holding images
+    int bs = 0;
+    _blockSize = ioctl(_status.device_fd, BLKSSZGET, &bs) == 0 && bs > 0 ? (size_t)bs : 4096;
+    return 0;
+}
+
+static bool _direct_aligned(const void * buf, size_t n, off_t pos) {
+    return ((uintptr_t)buf | n | (size_t)pos) % _blockSize == 0;
+}
+
+/// the aligned range around @pos .. @pos + @n that fits one bounce buffer
+static void _direct_window(size_t * n, off_t pos, off_t * lo, size_t * len) {
+    *lo = pos - pos % _blockSize;
+    if(*n > DIRECT_BUF_SIZE - (size_t)(pos - *lo)) *n = DIRECT_BUF_SIZE - (pos - *lo);
+    off_t hi = pos + *n;
+    hi += (_blockSize - hi % _blockSize) % _blockSize;
+    *len = hi - *lo;
+}
+
+static ssize_t _direct_read(void * buf, size_t n, off_t pos) {
+    if(_direct_aligned(buf, n, pos)) return pread(_status.device_fd, buf, n, pos);
+    off_t lo;
+    size_t len;
+    _direct_window(&n, pos, &lo, &len);
+    unsigned char * b = _pool_get();
+    if(b == NULL) return -1;
+    ssize_t r = pread(_status.device_fd, b, len, lo);
+    if(r > pos - lo) {
+        if((size_t)(r - (pos - lo)) < n) n = r - (pos - lo);
+        memcpy(buf, b + (pos - lo), n);
+        r = n;
+    } else if(r > 0) {
+        r = 0; // the end of the device is before @pos
+    }
+    _pool_put(b);
+    return r;
+}
+
+static ssize_t _direct_write(const void * buf, size_t n, off_t pos) {
+    if(_direct_aligned(buf, n, pos)) {
+        pthread_rwlock_rdlock(&_rmwLock);
+        ssize_t r = pwrite(_status.device_fd, buf, n, pos);
+        pthread_rwlock_unlock(&_rmwLock);
+        return r;
+    }
+    off_t lo;
+    size_t len;
+    _direct_window(&n, pos, &lo, &len);
+    unsigned char * b = _pool_get();
+    if(b == NULL) return -1;
+    ssize_t r = 0;
+    // only the first and the last block can hold bytes that are not overwritten
+    bool head = pos != lo, tail = (size_t)(pos - lo) + n < len;
+    pthread_rwlock_wrlock(&_rmwLock);
+    if((head || (tail && len == _blockSize)) && pread(_status.device_fd, b, _blockSize, lo) < 0) r = -1;
+    if(r == 0 && tail && len > _blockSize
+       && pread(_status.device_fd, b + len - _blockSize, _blockSize, lo + len - _blockSize) < 0) r = -1;
+    if(r == 0) {
+        memcpy(b + (pos - lo), buf, n);
+        r = pwrite(_status.device_fd, b, len, lo);
+        if(r >= (ssize_t)len) r = n;
+        else if(r > pos - lo) r = r - (pos - lo) < (ssize_t)n ? r - (pos - lo) : (ssize_t)n;
+        else if(r > 0) r = 0;
+    }
+    pthread_rwlock_unlock(&_rmwLock);
+    _pool_put(b);
+    return r;
+}
+
+static void _direct_close() {
+    close(_status.device_fd);
+    pthread_mutex_lock(&_poolLock);
+    while(_poolFree > 0) free(_pool[--_poolFree]);
+    pthread_mutex_unlock(&_poolLock);
+}
+
+const devBackend _devDirect = {"direct", _direct_open, _direct_read, _direct_write, _file_flush, _file_discard,
+                               _direct_close, false};
+
+const devBackend * _dev_backend(const char * name) {
+    if(name != NULL && strcmp(name, "ram") == 0) return &_devRam;
+    if(name != NULL && strcmp(name, "direct") == 0) return &_devDirect;
+    return &_devFile;
+}
+
+int _dev_flush() {
+    return _status.dev->flush();
+}
+
+int _dev_discard(off_t pos, off_t len) {
+    return _status.dev->discard(pos, len);
+}
+
+size_t _dev_read_raw(void * buf, size_t n, off_t pos) {
+    size_t done = 0;
+    while(done < n) {
+        ssize_t r = _status.dev->read((char *)buf + done, n - done, pos + done);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        done += r;
+    }
+    return done;
+}
+
+size_t _dev_write_raw(const void * buf, size_t n, off_t pos) {
+    size_t done = 0;
+    while(done < n) {
+        ssize_t r = _status.dev->write((const char *)buf + done, n - done, pos + done);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        done += r;
+    }
+    return done;
+}
@@ -0,0 +1,60 @@
+/**
+ Header file for the block device backends of the FAT32 API
+ */
+
+#ifndef _DEV32_H
+#define _DEV32_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/// bounce buffers kept by the O_DIRECT backend, more are allocated while all are in use
+#define DIRECT_POOL_BUFS 8
+
+/// size of one bounce buffer, larger unaligned transfers are split
+#define DIRECT_BUF_SIZE (1 << 20)
+
+/// a place the volume lives, chosen per mount by FAT_FS_BACKEND
+typedef struct {
+    const char * name;
+    /// open the image @path, 0 if succeed
+    int (*open)(const char * path, bool readOnly);
+    /// one transfer of at most @n bytes at @pos, like pread(2)
+    ssize_t (*read)(void * buf, size_t n, off_t pos);
+    /// one transfer of at most @n bytes at @pos, like pwrite(2)
+    ssize_t (*write)(const void * buf, size_t n, off_t pos);
+    /// make the writes so far durable, 0 if succeed
+    int (*flush)();
+    /// the range is no longer used, its content is undefined afterwards, 0 if succeed
+    int (*discard)(off_t pos, off_t len);
+    void (*close)();
+    /// _status.device_fd may be handed to copy_file_range, sendfile and posix_fadvise
+    bool kernelCopy;
+} devBackend;
+
+/// pread/pwrite on the image file, through the page cache (the default, "file")
+extern const devBackend _devFile;
+
+/// the image copied to memory at mount; writes are not kept after unmount ("ram")
+extern const devBackend _devRam;
+
+/// O_DIRECT on the image or raw device, unaligned transfers go through bounce buffers ("direct")
+extern const devBackend _devDirect;
+
+/// the backend named @name, the file backend if @name is NULL or unknown
+const devBackend * _dev_backend(const char * name);
+
+/// flush the device, 0 if succeed
+int _dev_flush();
+
+/// tell the device the range is free, 0 if succeed
+int _dev_discard(off_t pos, off_t len);
+
+/// read exactly @n bytes at @pos bypassing counters, tracing and the intent log, return bytes read
+size_t _dev_read_raw(void * buf, size_t n, off_t pos);
+
+/// write exactly @n bytes at @pos bypassing counters, tracing and the intent log, return bytes written
+size_t _dev_write_raw(const void * buf, size_t n, off_t pos);
+
+#endif
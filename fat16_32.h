@@ -5,6 +5,9 @@
 #ifndef _FAT16_32_H
 #define _FAT16_32_H
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 typedef struct{
     unsigned char jmpBoot[3];// = {0xEB, 0x00, 0x90};
     unsigned char OEMName[8];
@@ -69,6 +72,141 @@ typedef struct __attribute__ ((packed)) {
 } dirEnt;
 
 
+/// throughput report of OS_extract_tree
+typedef struct {
+    unsigned long files;          // number of files copied
+    unsigned long long bytes;     // number of bytes copied
+    double seconds;               // wall time of the whole extraction
+    double bytesPerSec;           // bytes / seconds
+} extractStat;
+
+/// geometry of a new volume for OS_format, fields left 0 take their defaults
+typedef struct {
+    uint64_t size;                // size of the image in bytes
+    unsigned int bytesPerSec;     // 512, 1024, 2048 or 4096
+    unsigned int secPerClus;      // power of two, at most 64KB per cluster
+    unsigned int numFATs;         // 1 to 4
+    unsigned int rsvdSecCnt;      // reserved sectors before the first FAT
+    unsigned int volID;           // volume serial number
+    const char * label;           // volume label, up to 11 chars
+} formatParam;
+
+/// OS_* entry points with a latency histogram in osStats
+enum {
+    OS_OP_CD, OS_OP_OPEN, OS_OP_CLOSE, OS_OP_READ, OS_OP_READDIR, OS_OP_MKDIR, OS_OP_RMDIR,
+    OS_OP_RM, OS_OP_CREAT, OS_OP_WRITE, OS_OP_EXPORT, OS_OP_IMPORT, OS_OP_EXTRACT_TREE,
+    OS_OP_BUILD_IMAGE, OS_OP_FORMAT, OS_OP_WALK, OS_OP_DEFRAG, OS_OP_FSYNC, OS_OP_APPEND,
+    OS_OP_SYNC, OS_OP_COMPACTDIR, OS_OP_RENAME, OS_OP_RMTREE, OS_OP_COUNT
+};
+
+/// number of log2 latency buckets, bucket i counts calls that took [2^i, 2^(i+1)) ns
+#define OS_STAT_BUCKETS 32
+
+/// counters of OS_stats, all of them count since the last reset
+typedef struct {
+    uint64_t devReads;            // read syscalls on the device
+    uint64_t devWrites;           // write syscalls on the device
+    uint64_t bytesRead;           // bytes read from the device
+    uint64_t bytesWritten;        // bytes written to the device
+    uint64_t fatReads;            // device reads inside the FAT region
+    uint64_t fatWrites;           // device writes inside the FAT region
+    uint64_t dirClusScanned;      // directory clusters read while scanning
+    uint64_t clusAllocated;       // FAT entries that went from free to used
+    uint64_t clusFreed;           // FAT entries that went from used to free
+    uint64_t cacheHits;           // metadata lookups served from memory
+    uint64_t cacheMisses;         // metadata lookups that went to the device
+    uint64_t journalCommits;      // records appended to the intent log
+    uint64_t journalSecs;         // sectors carried by those records
+    uint64_t journalCheckpoints;  // times the logged sectors were written in place
+    uint64_t latCount[OS_OP_COUNT];
+    uint64_t latSumNs[OS_OP_COUNT];
+    uint64_t latBuckets[OS_OP_COUNT][OS_STAT_BUCKETS];
+} osStats;
+
+/// region of the device a traceEvent falls in, stored in the low bits of flags
+#define TRACE_REGION_RESERVED 0
+#define TRACE_REGION_FAT 1
+#define TRACE_REGION_DATA 2
+#define TRACE_FLAG_WRITE 0x100
+
+#define TRACE_MAGIC "FAT32TRC"
+#define TRACE_VERSION 1
+
+/// one device access recorded by OS_trace_start
+typedef struct __attribute__ ((packed)) {
+    uint64_t timeNs;              // monotonic clock
+    uint64_t offset;              // device offset in bytes
+    uint32_t length;              // bytes moved
+    uint32_t cluster;             // data cluster, or FAT entry for the FAT region
+    int16_t op;                   // OS_OP_* running on the thread, -1 if none
+    uint16_t flags;               // TRACE_REGION_* | TRACE_FLAG_WRITE
+    uint32_t tid;                 // thread id
+} traceEvent;
+
+/// header of a file written by OS_trace_dump, followed by numEvents traceEvents
+typedef struct __attribute__ ((packed)) {
+    char magic[8];                // TRACE_MAGIC
+    uint32_t version;             // TRACE_VERSION
+    uint32_t eventSize;           // sizeof(traceEvent)
+    uint64_t numEvents;
+    uint32_t bytesPerSec;
+    uint32_t bytesPerCluster;
+} traceFileHeader;
+
+/// options of OS_fsck
+typedef struct {
+    int threads;                  // number of threads walking the tree
+    bool repair;                  // fix what can be fixed
+    int logFd;                    // every problem found is described here, -1 for none
+} fsckParam;
+
+/// problems found by OS_fsck
+typedef struct {
+    unsigned long dirs;
+    unsigned long files;
+    unsigned long crossLinked;    // chains running into a cluster owned by another chain
+    unsigned long badChains;      // chains running into a free or out of range cluster
+    unsigned long lostClusters;   // clusters in use in the FAT but owned by no chain
+    unsigned long sizeMismatch;   // files whose size does not match their chain
+    unsigned long mirrorDiffs;    // FAT entries that differ between the FAT copies
+    unsigned long repaired;       // problems fixed by the repair mode
+} fsckReport;
+
+/// an entry reported by OS_walk, valid only during the callback
+typedef struct {
+    const char * path;            // full path of the entry
+    const char * parentPath;      // full path of the dir holding it
+    const dirEnt * ent;
+    uint32_t parentClus;          // first cluster of the dir holding it
+    int depth;                    // 1 for the entries directly below the walk root
+} walkEnt;
+
+/// what OS_walk does after a callback
+#define WALK_CONTINUE 0           // go on, descend if the entry is a dir
+#define WALK_PRUNE 1              // go on, but do not descend into this dir
+#define WALK_STOP 2               // end the walk as soon as possible
+
+typedef int (*walkCallback)(const walkEnt *ent, void *arg);
+
+/// options of OS_defrag
+typedef struct {
+    bool relocate;                // move fragmented files, otherwise only report
+    unsigned int minExtents;      // files with at least this many runs are moved (default 2)
+    uint64_t maxBytesPerSec;      // copy rate limit, 0 for none
+    int logFd;                    // one line per file, -1 for none
+} defragParam;
+
+/// fragmentation found (and fixed) by OS_defrag
+typedef struct {
+    unsigned long files;
+    unsigned long fragmentedFiles; // files made of more than one run
+    unsigned long extents;        // runs over all files
+    unsigned long clusters;       // clusters over all files
+    double avgRunLen;             // clusters per run
+    unsigned long relocated;      // files moved to one run
+    unsigned long clustersMoved;
+    unsigned long skipped;        // fragmented files left alone: open, or no free run large enough
+} defragReport;
 
 extern int OS_cd(const char *path);
 
@@ -86,9 +224,72 @@ extern int OS_rmdir(const char *path);
 
 extern int OS_rm(const char *path); // remove a file
 
+extern int OS_rmtree(const char *path);
+// remove the directory @path and everything below it
+
+extern int OS_rename(const char *oldpath, const char *newpath);
+// move the entry @oldpath to @newpath without copying its data
+
+extern int OS_compactdir(const char *path);
+// pack the entries of the directory @path and free the clusters it no longer needs
+
 extern int OS_creat(const char *path);
 
 extern int OS_write(int fildes, const void *buf, int nbytes, int offset);
 // write to file specified by fildes
 
+extern ssize_t OS_pread64(int fd, void *buf, size_t nbyte, off_t offset);
+// read from file specified by fd, without the 2 GiB limits of OS_read
+
+extern ssize_t OS_pwrite64(int fildes, const void *buf, size_t nbytes, off_t offset);
+// write to file specified by fildes, without the 2 GiB limits of OS_write
+
+extern int OS_append(int fildes, const void *buf, int nbytes);
+// write at the end of file specified by fildes
+
+extern int OS_fsync(int fd);
+// write the delayed data of @fd and flush the device
+
+extern int OS_sync();
+// commit the metadata updates logged so far (see FAT_FS_JOURNAL)
+
+extern ssize_t OS_export(const char *path, int host_fd);
+// copy file @path to the host file @host_fd
+
+extern ssize_t OS_import(const char *host_path, const char *path);
+// create file @path with the content of the host file @host_path
+
+extern int OS_extract_tree(const char *src_dir, const char *host_dir, int threads, extractStat *stat);
+// copy the tree under @src_dir to the host directory @host_dir using @threads workers
+
+extern int OS_build_image(const char *host_dir);
+// fill the empty volume with a copy of the host directory tree @host_dir
+
+extern int OS_format(const char *path, const formatParam *param);
+// create a FAT32 image at @path
+
+extern void OS_stats(osStats *out, bool reset);
+// copy all operation counters to @out, clear them if @reset
+
+extern int OS_stats_prometheus(int fd);
+// write all operation counters to @fd in Prometheus text format
+
+extern int OS_trace_start(size_t numEvents);
+// record device accesses into an in-memory ring of @numEvents events
+
+extern void OS_trace_stop();
+// stop recording device accesses
+
+extern long OS_trace_dump(const char *path);
+// write the recorded device accesses to the file @path
+
+extern int OS_fsck(const fsckParam *param, fsckReport *report);
+// check the volume and optionally repair it
+
+extern long OS_walk(const char *root, walkCallback cb, void *arg, int threads);
+// call @cb for every entry below @root, using @threads workers
+
+extern int OS_defrag(const defragParam *param, defragReport *report);
+// report the fragmentation of the files and optionally move them to contiguous runs
+
 #endif
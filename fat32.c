@@ -20,11 +20,22 @@
   * of @buffer to file with descriptor @fd
  OS_rmdir(const char *dirname): remove directory @dirname
  OS_rm(const char *filename): remove file @filename
+ OS_rmtree(const char *dirname): remove directory @dirname and everything below it
+ OS_rename(const char *oldpath, const char *newpath): move the entry @oldpath to @newpath
+ OS_compactdir(const char *dirname): pack the entries of directory @dirname and free its
+  * unused clusters
+ OS_export(const char *path, int host_fd): copy file @path to the host file @host_fd
+ OS_import(const char *host_path, const char *path): copy the host file @host_path to
+  * a new file @path
  */
 
 #include "fat16_32.h"
 #include "fat32api.h"
 #include "utils32.h"
+#include "stats32.h"
+#include "journal32.h"
+#include "index32.h"
+#include "dev32.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -34,7 +45,7 @@
 #include <unistd.h>
 
 DriverStatus _status =
-{.openedFiles = {NULL},
+{.fdTable = NULL,
 .initialized = false,
 .device_fd = 0,
 .curdir = NULL,
@@ -43,9 +54,18 @@ DriverStatus _status =
 
 void _OS_initialization() {
     char *strEnv = getenv("FAT_FS_PATH"); // get the environment variable, path to the file
-    _status.device_fd = open(strEnv, O_RDWR, 0);
+    char *strRO = getenv("FAT_FS_READONLY"); // nothing is changed, the tree is indexed at mount
+    _status.readOnly = strRO != NULL && strcmp(strRO, "") != 0 && strcmp(strRO, "0") != 0;
+    _status.dev = _dev_backend(getenv("FAT_FS_BACKEND")); // "file" (default), "ram" or "direct"
+    // without a volume _status.initialized stays false and every call fails with -1
+    if(_status.dev->open(strEnv, _status.readOnly) != 0) return;
     FAT32_BPB *bpb_info = (FAT32_BPB *)malloc(sizeof(FAT32_BPB));
-    read(_status.device_fd, (void *)bpb_info, sizeof(FAT32_BPB) ); // read the BPB info from disk
+    if(_dev_read_raw((void *)bpb_info, sizeof(FAT32_BPB), 0) != sizeof(FAT32_BPB) // read the BPB info from disk
+       || bpb_info->bpb_common.BytsPerSec == 0 || bpb_info->bpb_common.SecPerClus == 0) {
+        free(bpb_info);
+        _status.dev->close();
+        return;
+    }
 
     // Calculate parameters for convenience
     _status.BytesPerSec = bpb_info->bpb_common.BytsPerSec;
@@ -57,20 +77,56 @@ void _OS_initialization() {
     _status.FATSz = bpb_info->FATSz32;
     _status.startDataSec = _status.startFATSec + bpb_info->bpb_common.NumFATs * bpb_info->FATSz32;
     _status.idxRootDirClus = bpb_info->RootClus;
+    unsigned int totSec = bpb_info->bpb_common.TotSec16 ?
+        bpb_info->bpb_common.TotSec16 : bpb_info->bpb_common.TotSec32;
+    _status.totalClus = (totSec - _status.startDataSec) / bpb_info->bpb_common.SecPerClus + 2;
+    _geom_select(); // shifts and masks instead of divisions for the common geometries
+    _status.volID = bpb_info->VolID;
+    char *strPlace = getenv("FAT_FS_PLACEMENT");
+    _status.placement = strPlace != NULL && strcmp(strPlace, "near") == 0 ? PLACE_NEAR : PLACE_FIRST;
+    char *strJournal = getenv("FAT_FS_JOURNAL"); // log file of the metadata updates, replayed here
+    if(strJournal != NULL && !_status.readOnly) _journal_open(strJournal);
+    // delayed data of the files still open is written at exit, before the journal commits
+    static bool registered = false;
+    if(!registered) registered = atexit(_flush_all) == 0;
 
     _status.curdir = malloc(sizeof(dirEnt)); // there is no dirEnt for root directory
     _initVirtualRootDirEnt(_status.curdir); // so we make up a virtual dirEnt for root
     _status.initialized = true;
-    memset(_status.openedFiles, 0, sizeof(dirEnt *) * MAX_NUM_FILE);
+    // after initialized, the build reads through the usual helpers; FAT_FS_INDEX keeps it across mounts
+    if(_status.readOnly) _index_start(getenv("FAT_FS_INDEX"));
     free(bpb_info);
     /* initialize all pointers to NULL*/
     return;
 }
 
+/// close the device and drop all state, the next call initializes again
+void _OS_finalization() {
+    if(!_status.initialized) return;
+    int fd;
+    for(fd = 0; fd < _status.fdCap; fd++) {
+        if(_status.fdTable[fd] != NULL) OS_close(fd);
+    }
+    free(_status.fdTable);
+    free(_status.fdFree);
+    _status.fdTable = NULL;
+    _status.fdFree = NULL;
+    _status.fdCap = 0;
+    _status.numFree = 0;
+    free(_status.curdir);
+    _status.curdir = NULL;
+    _journal_close();
+    _index_stop();
+    _status.dev->close();
+    _status.initialized = false;
+}
+
 
 int OS_cd(const char *path) {
+    STAT_TIMED(OS_OP_CD);
     //if not initialized, initialize
     if(_status.initialized != 1) _OS_initialization();
+    if(!_status.initialized) return -1;
     dirEnt *ptr = _OS_getEnt(path);
     if(!ptr) return -1;
     free(_status.curdir);
@@ -81,7 +137,9 @@ int OS_cd(const char *path) {
 }
 
 int OS_open(const char *path){
+    STAT_TIMED(OS_OP_OPEN);
     if(_status.initialized != 1) _OS_initialization();
+    if(!_status.initialized) return -1;
     dirEnt *ptr = _OS_getEnt(path);
 
     /// get the dirEnt of parent dir
@@ -89,51 +147,94 @@ int OS_open(const char *path){
     dirEnt *parent_ptr = _OS_getEnt(parent_path);
     free(parent_path);
 
-    if(!ptr) return -1;
-    int fd = 0;
-    for( ; fd < MAX_NUM_FILE; fd++){
-        if(_status.openedFiles[fd] == NULL){
-            _status.openedFiles[fd] = ptr;// find the first available file descriptor
-            _status.openedFilesParent[fd] = parent_ptr;
-            return fd;
-        }
+    if(!ptr || !parent_ptr) {
+        free(ptr);
+        free(parent_ptr);
+        return -1;
     }
+    // opens of the same file share its entry, so they see each other's size updates
+    int fd = _fd_open(ptr, parent_ptr->dir_fstClusLO + ((uint32_t)parent_ptr->dir_fstClusHI << 16));
     free(ptr);
-    return -1;
+    free(parent_ptr);
+    return fd;
 }
 
 int OS_close(int fd){
+    STAT_TIMED(OS_OP_CLOSE);
     if(_status.initialized != 1) _OS_initialization();
-    if(_status.openedFiles[fd]==NULL){
+    if(!_status.initialized) return -1;
+    openFile * of = _fd_get(fd);
+    if(of == NULL){
         return -1;
     } else {
-        free(_status.openedFiles[fd]);
-        free(_status.openedFilesParent[fd]);
-        _status.openedFiles[fd] = NULL;
-        _status.openedFilesParent[fd] = NULL;
-        return 1;
+        // the fd is released even if its delayed data cannot be placed, like close(2)
+        int excode = _flush_fd(fd) ? -2 : 1;
+        if(of->refs == 1) _chain_trim(fd);
+        _fd_close(fd);
+        return excode;
     }
 }
 
+/** write the buffered and delayed data of @fd to the device and flush the device
+ * @return 1 if succeed, -1 if @fd is invalid, -2 if there is no space for the data or the
+ * intent log could not be written
+ */
+int OS_fsync(int fd) {
+    STAT_TIMED(OS_OP_FSYNC);
+    if(_status.initialized != 1) _OS_initialization();
+    if(!_status.initialized) return -1;
+    if(_fd_get(fd) == NULL) return -1;
+    if(_flush_fd(fd)) return -2;
+    if(_journal_sync()) return -2;
+    _dev_flush();
+    return 1;
+}
+
 
 int OS_read(int fd, void *buf, int nbyte, int offset){
+    if(nbyte < 0 || offset < 0) return -1;
+    return OS_pread64(fd, buf, nbyte, offset);
+}
+
+/** read up to @nbyte bytes at @offset of the file @fd into @buf
+ * transfers are not split: every run of contiguous clusters is read with one call
+ * @return number of bytes read, -1 if @fd is invalid or @offset is past the end of the file
+ */
+ssize_t OS_pread64(int fd, void *buf, size_t nbyte, off_t offset){
+    STAT_TIMED(OS_OP_READ);
     if(_status.initialized != 1) _OS_initialization();
+    if(!_status.initialized) return -1;
     /** get the first cluster idx */
-    if(_status.openedFiles[fd] == NULL) {
+    openFile * of = _fd_get(fd);
+    if(of == NULL || offset < 0) {
         return -1;
     }
-    int nbyte_really = nbyte; // number of bytes really read
-    if(nbyte + offset > _status.openedFiles[fd]->dir_fileSize){
-        nbyte_really = (int)(_status.openedFiles[fd]->dir_fileSize) - offset;
-        if(nbyte_really < 0) return -1;
+    uint64_t size = of->ent.dir_fileSize;
+    if((uint64_t)offset > size) return -1;
+    size_t nbyte_really = nbyte; // number of bytes really read
+    if(nbyte > size - offset) nbyte_really = size - offset;
+    uint32_t fstCluster = of->ent.dir_fstClusHI * 65536 + of->ent.dir_fstClusLO;
+    fileState * fs = &of->st;
+    if(fs->bufLen == 0 && fstCluster != 0) return _OS_read_file(fstCluster, offset, nbyte_really, buf);
+
+    // what is on the device, zeros past it, then the buffered data on top
+    uint64_t end = offset + nbyte_really;
+    size_t onDisk = 0;
+    if(fstCluster != 0 && offset < fs->diskSize) {
+        onDisk = (end < fs->diskSize ? end : fs->diskSize) - offset;
+        _OS_read_file(fstCluster, offset, onDisk, buf);
     }
-    unsigned int fstCluster = _status.openedFiles[fd]->dir_fstClusHI * 65536
-        + _status.openedFiles[fd]->dir_fstClusLO;
-    return _OS_read_file(fstCluster, offset, nbyte_really, buf);
+    if(onDisk < nbyte_really) memset((char *)buf + onDisk, 0, nbyte_really - onDisk);
+    uint64_t lo = (uint64_t)offset > fs->bufOff ? (uint64_t)offset : fs->bufOff;
+    uint64_t hi = end < (uint64_t)fs->bufOff + fs->bufLen ? end : (uint64_t)fs->bufOff + fs->bufLen;
+    if(lo < hi) memcpy((char *)buf + (lo - offset), fs->buf + (lo - fs->bufOff), hi - lo);
+    return nbyte_really;
 }
 
 dirEnt * OS_readDir(const char * dirname) {
+    STAT_TIMED(OS_OP_READDIR);
     if(_status.initialized != 1) _OS_initialization();
+    if(!_status.initialized) return NULL;
     dirEnt * ent = _OS_getEnt(dirname);
     if(ent == NULL) return NULL;
     if(ent->dir_attr != 0x10) {
@@ -163,6 +264,7 @@ dirEnt * OS_readDir(const char * dirname) {
             volBuffer *= 2;
         }
         _OS_read_file(startCluster, i * _status.BytesPerCluster, _status.BytesPerCluster, dirEntBuf + sizeBuffer);
+        STAT_ADD(dirClusScanned, 1);
         int j;
         for(j = sizeBuffer; j < sizeBuffer + numDirEntPerClus; j++)
         {
@@ -181,7 +283,11 @@ dirEnt * OS_readDir(const char * dirname) {
 }
 
 int OS_mkdir(const char * path) {
+    STAT_TIMED(OS_OP_MKDIR);
     if(!_status.initialized)_OS_initialization();
+    if(!_status.initialized) return -1;
+    if(_status.readOnly) return -1;
+    JOURNAL_OP();
 
     // first check whether this dir already exists
     dirEnt *self_dirEnt = _OS_getEnt(path);
@@ -203,18 +309,19 @@ int OS_mkdir(const char * path) {
     // if parent dir not found, return with error
     if(parent_dirEnt == NULL) {return -1;}
 
-    // get the list of parent dir, then we can get how many entries are already used
-    dirEnt * list_parent_dirEnt = OS_readDir(parentdir);
-    int i = 0;
-    while(list_parent_dirEnt[i].dir_name[0]!=0 && list_parent_dirEnt[i].dir_name[0] != 0xE5) i++;
-    //now i is the number of existing entries
-    // if this is the last dirEnt, then write 2 dirEnts (with an empty one)
-    // if this is not the last one (starting with 0xE5), the write one
-    int num_ent_write = list_parent_dirEnt[i].dir_name[0] == 0xE5 ? 1 : 2;
-    free(list_parent_dirEnt); list_parent_dirEnt = NULL;
-    
-    //get a new cluster
-    uint32_t new_clus_idx = _findFirstEmptyClus();
+    // the first deleted slot of the parent dir, or its end
+    uint32_t parent_clus_idx = parent_dirEnt->dir_fstClusLO + ((uint32_t)parent_dirEnt->dir_fstClusHI << 16);
+    bool atEnd;
+    int i = _free_slot(parent_clus_idx ? parent_clus_idx : _status.idxRootDirClus, &atEnd);
+    // if this is the end, then write 2 dirEnts (with an empty one)
+    // if this is a deleted one (starting with 0xE5), the write one
+    int num_ent_write = atEnd ? 2 : 1;
+
+    //get a new cluster, top level dirs are spread over the volume
+    if(parent_clus_idx == 0 && _status.placement == PLACE_NEAR) parent_clus_idx = _spreadGoal();
+    uint32_t new_clus_idx = _allocClus(parent_clus_idx);
+    // take it at once, the parent dir may need a cluster of its own for the new entry
+    _setFATvalue(new_clus_idx, 0x0FFFFFFF);
     dirEnt append_ent[3];
     memset(append_ent, 0, 3 * sizeof(dirEnt));
 
@@ -247,8 +354,6 @@ int OS_mkdir(const char * path) {
     append_ent[1].dir_name[0] = '.';
     append_ent[1].dir_name[1] = '.';
 
-    // set the value of the new directory in FAT
-    _setFATvalue(new_clus_idx, 0x0FFFFFFF);
     _OS_write_file(new_clus_idx , append_ent, 3*sizeof(dirEnt), 0);
 
     free(parentdir);
@@ -264,7 +369,11 @@ int OS_mkdir(const char * path) {
  * @TODO unify this function with OS_mkdir
  */
 int OS_creat(const char *path) {
+    STAT_TIMED(OS_OP_CREAT);
     if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    if(_status.readOnly) return -1;
+    JOURNAL_OP();
 
     // first check whether this dir already exists
     dirEnt *self_dirEnt = _OS_getEnt(path);
@@ -286,20 +395,17 @@ int OS_creat(const char *path) {
     // if parent dir not found, return with error
     if(parent_dirEnt == NULL) return -1;
 
-    // get the list of parent dir, then we can get how many entries are already used
-    dirEnt * list_parent_dirEnt = OS_readDir(parentdir);
-    int i = 0;
-    while(list_parent_dirEnt[i].dir_name[0]!=0 && list_parent_dirEnt[i].dir_name[0] != 0xE5) i++;
-    
-    /// if this is the last dirEnt, then write 2 dirEnts (with an empty one)
-    /// if this is not the last one (starting with 0xE5), the write one
-    int num_ent_write = list_parent_dirEnt[i].dir_name[0] == 0xE5 ? 1 : 2;
-    free(list_parent_dirEnt); list_parent_dirEnt = NULL;
-    //now i is the pointer to the first empty entries
+    // the first deleted slot of the parent dir, or its end
+    uint32_t parent_clus_idx = parent_dirEnt->dir_fstClusLO + ((uint32_t)parent_dirEnt->dir_fstClusHI << 16);
+    bool atEnd;
+    int i = _free_slot(parent_clus_idx ? parent_clus_idx : _status.idxRootDirClus, &atEnd);
+
+    /// if this is the end, then write 2 dirEnts (with an empty one)
+    /// if this is a deleted one (starting with 0xE5), the write one
+    int num_ent_write = atEnd ? 2 : 1;
     
 
-    //get a new cluster
-    uint32_t new_clus_idx = _findFirstEmptyClus();
+    // the file gets no cluster yet, they are allocated in one run when its data is flushed
     dirEnt append_ent[2];
     memset(append_ent, 0, 2 * sizeof(dirEnt));
 
@@ -307,8 +413,6 @@ int OS_creat(const char *path) {
     append_ent[0].dir_attr = 0x20; // it is a file
     append_ent[0].dir_wrtTime = 0;
     append_ent[0].dir_wrtDate = 0;
-    append_ent[0].dir_fstClusLO = new_clus_idx & 0xFFFF;
-    append_ent[0].dir_fstClusHI = new_clus_idx >> 16;
     flnm2FAT(filename_buffer,append_ent[0].dir_name);
 
     ///write the appended dirEnts to parent dirEnt
@@ -322,65 +426,135 @@ int OS_creat(const char *path) {
         _OS_write_file(parent_dirEnt->dir_fstClusLO + ((uint32_t)parent_dirEnt->dir_fstClusHI << 16),
                    append_ent, num_ent_write*sizeof(dirEnt), i*sizeof(dirEnt) );
     }
-    _setFATvalue(new_clus_idx, 0x0FFFFFFF);
     free(parentdir);
     free(parent_dirEnt);
     return 1;
 }
 
 int OS_write(int fildes, const void * buf, int nbytes, int offset) {
+    if(nbytes < 0 || offset < 0) return -1;
+    return OS_pwrite64(fildes, buf, nbytes, offset);
+}
+
+/** write @nbytes of @buf at @offset of the file @fildes
+ * transfers are not split, a file can grow up to the FAT32 limit of 4 GiB - 1
+ * @return number of bytes written, -1 if @fildes or @offset is invalid,
+ * -2 if the file would grow past the FAT32 limit, -3 if the data could not be written
+ */
+ssize_t OS_pwrite64(int fildes, const void * buf, size_t nbytes, off_t offset) {
+    STAT_TIMED(OS_OP_WRITE);
     if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
     // if @fildes is invalid, return -1
-    if(_status.openedFiles[fildes] == NULL) {return -1;}
+    openFile * of = _fd_get(fildes);
+    if(of == NULL || offset < 0 || _status.readOnly) {return -1;}
+    uint64_t end = (uint64_t)offset + nbytes;
+    if(end > FAT32_MAX_FILE_SIZE) return -2;
+
+    // a file without clusters collects all its data in memory (delayed allocation),
+    // other files coalesce small writes that follow each other in a WRITEBUF_CLUS buffer
+    fileState * fs = &of->st;
+    bool delayed = of->ent.dir_fstClusLO == 0 && of->ent.dir_fstClusHI == 0;
+    if(delayed && end > DELALLOC_MAX) {
+        // too large to hold: place what is held and room for this write in one run
+        if(_place_fd(fildes, end)) return -3;
+        fs->bufOff = 0;
+        fs->bufLen = 0;
+        fs->diskSize = of->ent.dir_fileSize;
+        delayed = false;
+    }
+    uint32_t cap = delayed ? DELALLOC_MAX : WRITEBUF_CLUS * _status.BytesPerCluster;
+    if(!delayed && fs->bufLen > 0 && (nbytes >= cap || (uint64_t)offset < fs->bufOff
+       || (uint64_t)offset > (uint64_t)fs->bufOff + fs->bufLen || end - fs->bufOff > cap)) {
+        if(_flush_fd(fildes)) return -3; // not a continuation of the buffered data
+    }
+    if(delayed || nbytes < cap) {
+        if(fs->bufLen == 0) fs->bufOff = delayed ? 0 : offset;
+        if(end - fs->bufOff > fs->bufVol) {
+            uint32_t vol = fs->bufVol ? 2 * fs->bufVol : _status.BytesPerCluster;
+            while(vol < end - fs->bufOff) vol *= 2;
+            unsigned char * p = realloc(fs->buf, vol);
+            if(p == NULL) return -3;
+            fs->buf = p;
+            fs->bufVol = vol;
+        }
+        if(offset > fs->bufOff + fs->bufLen) memset(fs->buf + fs->bufLen, 0, offset - fs->bufOff - fs->bufLen);
+        memcpy(fs->buf + (offset - fs->bufOff), buf, nbytes);
+        if(end - fs->bufOff > fs->bufLen) fs->bufLen = end - fs->bufOff;
+        if(of->ent.dir_fileSize < end) of->ent.dir_fileSize = end;
+        if(fs->bufLen >= cap && _flush_fd(fildes)) return -3;
+        return nbytes;
+    }
 
-    int actual_written_bytes = _OS_write_file(_status.openedFiles[fildes]->dir_fstClusLO +
-        ( (uint32_t)_status.openedFiles[fildes]->dir_fstClusHI << 16 )
-        , buf, nbytes, offset);
+    // large writes go straight to the device
+    if(_write_fd(fildes, buf, nbytes, offset)) return -3;
 
     // update the file size in the dirEnt
-    if (_status.openedFiles[fildes]->dir_fileSize < nbytes + offset ) _status.openedFiles[fildes]->dir_fileSize = nbytes + offset ;
+    if (of->ent.dir_fileSize < end) of->ent.dir_fileSize = end;
 
     // write the update of dirEnt to filesystem
-    // calculate the idx of start cluster of parent directory
-    uint32_t start_idx_parent_dir = _status.openedFilesParent[fildes]->dir_fstClusLO +
-                   ( ( (uint32_t)_status.openedFilesParent[fildes]->dir_fstClusHI ) << 16 );
-
-    // if it is the root dir then correct the idx
-    if(start_idx_parent_dir == 0) start_idx_parent_dir = _status.idxRootDirClus;
-    _update_dirEnt(start_idx_parent_dir, _status.openedFiles[fildes] );
-    return actual_written_bytes;
+    _update_open(of);
+    fs->diskSize = of->ent.dir_fileSize;
+    return nbytes;
+}
+
+/** write @nbytes of @buf at the end of the file @fildes
+ * the end of the chain is remembered by the fd, so appending does not walk the chain,
+ * and the chain is grown geometrically ahead of the data; what is left when the fd is
+ * closed is freed again
+ * @return number of bytes appended, -1 if @fildes is invalid
+ */
+int OS_append(int fildes, const void * buf, int nbytes) {
+    STAT_TIMED(OS_OP_APPEND);
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    openFile * of = _fd_get(fildes);
+    if(of == NULL || nbytes < 0 || _status.readOnly) return -1;
+    _chain_load(fildes);
+    return OS_pwrite64(fildes, buf, nbytes, of->ent.dir_fileSize);
 }
 
 ///Remove file specified in @path
 ///@return: 1 if succeed, -1 if the path is valid
-///-2 if it is a directory
+///-2 if it is a directory, -3 if it is open
 int OS_rm(const char *path) {
+    STAT_TIMED(OS_OP_RM);
     if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    if(_status.readOnly) return -1;
+    JOURNAL_OP();
     dirEnt *p = _OS_getEnt(path);
     if(p == NULL) return -1;
     int excode = 0;
     uint32_t startClusterIdx;
+    char * path_parent = NULL;
+    dirEnt * parentEnt = NULL;
     switch(p->dir_attr){
         case 0x10:
              excode = -2;
              break;
         case 0x20:
+             path_parent = _get_parent_path(path, NULL);
+             parentEnt = _OS_getEnt(path_parent);
+             if (parentEnt == NULL) {excode = -1; break;}
+             // the buffered or delayed data of an open file would be written later, into
+             // clusters other files may have got by then
+             if (_open_slot(parentEnt->dir_fstClusLO + ((uint32_t)parentEnt->dir_fstClusHI << 16), p->dir_name)) {
+                 excode = -3;
+                 break;
+             }
              startClusterIdx = p->dir_fstClusLO + ( ((uint32_t) p->dir_fstClusHI) << 16);
              _remove_link(startClusterIdx);
-             char * path_parent = _get_parent_path(path, NULL);
-             dirEnt *parentEnt = _OS_getEnt(path_parent);
-             if (parentEnt == NULL) excode = -1;
-             else {
-                 // remove the corresponding entry in parent dir's list
-                 _delete_dirEnt(path_parent, p->dir_name);
-                 free(path_parent);
-             }
+             // remove the corresponding entry in parent dir's list
+             _delete_dirEnt(path_parent, p->dir_name);
              excode = 1;
              break;
         default:
              excode = -1;
 
     }
+    free(parentEnt);
+    free(path_parent);
     free(p);
     return excode;
 }
@@ -388,11 +562,15 @@ int OS_rm(const char *path) {
 /** remove the directory specified by @path
 * @return : 1 if succeed, -1 if @path is invalid,
 * -2 if @path does not refer to a directory
-* -3 if @path is not empty
+* -3 if @path is not empty or is open
 */
 int OS_rmdir(const char *path)
 {
+    STAT_TIMED(OS_OP_RMDIR);
     if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    if(_status.readOnly) return -1;
+    JOURNAL_OP();
     int excode = 1;
     // get the dirEnt of this path
     dirEnt * p = _OS_getEnt(path);
@@ -408,22 +586,400 @@ int OS_rmdir(const char *path)
             }
         }
         free(dir_content);
+        char * parent = _get_parent_path(path, NULL);
+        dirEnt * parent_dirEnt = _OS_getEnt(parent);
+        if(isempty && parent_dirEnt != NULL
+           && _open_slot(parent_dirEnt->dir_fstClusLO + ((uint32_t)parent_dirEnt->dir_fstClusHI << 16), p->dir_name))
+            isempty = false; // still open, writes through its fds would land in freed clusters
         if(isempty) {
             printf("Debug: empty file detected\n");
-            char * parent = _get_parent_path(path, NULL);
-            dirEnt * parent_dirEnt = _OS_getEnt(parent);
             _remove_link( p->dir_fstClusLO + ((uint32_t)p->dir_fstClusHI << 16) );
             printf("Debug: dir body deleted\n");
             _delete_dirEnt(parent, p->dir_name);
             printf("Debug: dir ent deleted\n");
-            free(parent_dirEnt);
-            free(parent);
         } else {
             excode = -3;
         }
+        free(parent_dirEnt);
+        free(parent);
     } else {
         excode = -2;
     }
     free(p);
     return excode;
 }
+
+/** move the entry @oldpath to @newpath, in the same dir or another one. Only directory
+ * entries change: the new entry is written first, then the ".." of a moved directory, then
+ * the old entry is deleted, so a crash leaves at worst both entries (reported by OS_fsck
+ * as a cross-link), never none; with FAT_FS_JOURNAL the whole call is one logged update.
+ * fds open on the file keep working under the new name
+ * @return 1 if succeed, -1 if a path is invalid, -2 if @newpath already exists,
+ * -3 if a directory would be moved below itself
+ */
+int OS_rename(const char *oldpath, const char *newpath)
+{
+    STAT_TIMED(OS_OP_RENAME);
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    if(_status.readOnly) return -1;
+    JOURNAL_OP();
+    dirEnt * ent = _OS_getEnt(oldpath);
+    if(ent == NULL) return -1;
+    dirEnt * self_dirEnt = _OS_getEnt(newpath);
+    if(self_dirEnt != NULL) {
+        free(self_dirEnt);
+        free(ent);
+        return -2;
+    }
+    char oldname[strlen(oldpath) + 1], newname[strlen(newpath) + 1];
+    uint8_t newFATname[11];
+    char * oldparent = _get_parent_path(oldpath, oldname);
+    char * newparent = _get_parent_path(newpath, newname);
+    dirEnt * oldparent_dirEnt = oldparent ? _OS_getEnt(oldparent) : NULL;
+    dirEnt * newparent_dirEnt = newparent ? _OS_getEnt(newparent) : NULL;
+    int excode = 1;
+    if(oldparent_dirEnt == NULL || newparent_dirEnt == NULL || !(newparent_dirEnt->dir_attr & 0x10)
+       || ent->dir_name[0] == '.' || strlen(newname) > 12 || flnm2FAT(newname, newFATname)) {
+        excode = -1;
+        goto done;
+    }
+    uint32_t clus = ent->dir_fstClusLO + ((uint32_t)ent->dir_fstClusHI << 16);
+    uint32_t oldParentClus = oldparent_dirEnt->dir_fstClusLO + ((uint32_t)oldparent_dirEnt->dir_fstClusHI << 16);
+    uint32_t newParentClus = newparent_dirEnt->dir_fstClusLO + ((uint32_t)newparent_dirEnt->dir_fstClusHI << 16);
+    bool isDir = ent->dir_attr & 0x10;
+
+    // a directory cannot go below itself: climb from the new parent to the root through ".."
+    if(isDir) {
+        uint32_t up = newParentClus;
+        while(up != 0 && up != _status.idxRootDirClus && up != clus) {
+            dirEnt dotdot;
+            if(_OS_read_file(up, sizeof(dirEnt), sizeof(dirEnt), &dotdot) != sizeof(dirEnt)) break;
+            up = dotdot.dir_fstClusLO + ((uint32_t)dotdot.dir_fstClusHI << 16);
+        }
+        if(up == clus) {
+            excode = -3;
+            goto done;
+        }
+    }
+
+    // 1. the new entry
+    uint8_t oldFATname[11];
+    memcpy(oldFATname, ent->dir_name, 11);
+    memcpy(ent->dir_name, newFATname, 11);
+    if(_add_dirEnt(newparent, ent)) {
+        excode = -1;
+        goto done;
+    }
+    // 2. the ".." of a directory that changes parent
+    if(isDir && oldParentClus != newParentClus) {
+        dirEnt dotdot;
+        _OS_read_file(clus, sizeof(dirEnt), sizeof(dirEnt), &dotdot);
+        uint32_t up = newParentClus == _status.idxRootDirClus ? 0 : newParentClus;
+        dotdot.dir_fstClusLO = up & 0xFFFF;
+        dotdot.dir_fstClusHI = up >> 16;
+        _OS_write_file(clus, &dotdot, sizeof(dirEnt), sizeof(dirEnt));
+    }
+    // 3. the old entry
+    _delete_dirEnt(oldparent, oldFATname);
+    _open_move(oldParentClus, oldFATname, newParentClus, newFATname);
+
+done:
+    free(oldparent_dirEnt);
+    free(newparent_dirEnt);
+    free(oldparent);
+    free(newparent);
+    free(ent);
+    return excode;
+}
+
+/** rewrite the directory @path with its entries packed at its start, "." and ".." staying
+ * first, and give the clusters it no longer needs back to the FAT.
+ * entries only move towards the start and the clusters are written in order, so a crash
+ * leaves at worst an entry twice (reported by OS_fsck), never a lost one; with
+ * FAT_FS_JOURNAL the whole call is one logged update
+ * @return number of clusters released, -1 if @path is invalid, -2 if it is not a directory
+ */
+int OS_compactdir(const char *path)
+{
+    STAT_TIMED(OS_OP_COMPACTDIR);
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    if(_status.readOnly) return -1;
+    JOURNAL_OP();
+    dirEnt * p = _OS_getEnt(path);
+    if(p == NULL) return -1;
+    bool isDir = p->dir_attr & 0x10;
+    uint32_t start = p->dir_fstClusLO + ((uint32_t)p->dir_fstClusHI << 16);
+    free(p);
+    if(!isDir) return -2;
+    if(start == 0) start = _status.idxRootDirClus;
+
+    const uint32_t numDirEntPerClus = _status.BytesPerCluster / sizeof(dirEnt);
+    int numExt = 0, e;
+    extent * ext = _get_extents(start, 0, &numExt);
+    uint32_t numClus = 0;
+    for(e = 0; e < numExt; e++) numClus += ext[e].count;
+    dirEnt * slots = calloc(numClus, _status.BytesPerCluster);
+    uint32_t k = 0;
+    for(e = 0; e < numExt; e++) {
+        _dev_read(slots + k * numDirEntPerClus, (size_t)ext[e].count * _status.BytesPerCluster,
+                  _clusterPos(ext[e].start));
+        k += ext[e].count;
+    }
+    STAT_ADD(dirClusScanned, numClus);
+
+    // keep everything but the deleted slots, in order: ".", ".." and the volume label stay first
+    uint32_t n = 0, i;
+    for(i = 0; i < numClus * numDirEntPerClus && slots[i].dir_name[0] != '\0'; i++)
+        if(slots[i].dir_name[0] != 0xE5) slots[n++] = slots[i];
+    uint32_t keep = n / numDirEntPerClus + 1; // room for the end marker too
+    if(keep > numClus) keep = numClus;
+    if(n == i && keep == numClus) { // nothing to pack
+        free(slots);
+        free(ext);
+        return 0;
+    }
+    memset(slots + n, 0, ((size_t)keep * numDirEntPerClus - n) * sizeof(dirEnt));
+    _OS_write_file(start, slots, (size_t)keep * _status.BytesPerCluster, 0);
+
+    // cut the chain after the kept clusters
+    if(keep < numClus) {
+        uint32_t last = 0, next = 0;
+        k = 0;
+        for(e = 0; e < numExt; k += ext[e].count, e++) {
+            if(keep - 1 >= k && keep - 1 < k + ext[e].count) last = ext[e].start + (keep - 1 - k);
+            if(keep >= k && keep < k + ext[e].count) next = ext[e].start + (keep - k);
+        }
+        _setFATvalue(last, 0x0FFFFFFF);
+        _remove_link(next);
+    }
+    free(slots);
+    free(ext);
+    return numClus - keep;
+}
+
+static int _cmp_clus(const void * a, const void * b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/** remove the directory @path and everything below it.
+ * the subtree is walked by cluster, every chain in it is collected into one set of runs,
+ * then the entry of @path is deleted from its parent and the runs are freed with one
+ * write per FAT sector. A crash in between leaves lost clusters (reclaimed by OS_fsck),
+ * never an entry on free clusters. Entries below @path are left as they are.
+ * @return 1 if succeed, -1 if @path is invalid, -2 if it is not a directory,
+ * -3 if a file below it is open or the working directory is below it
+ */
+int OS_rmtree(const char *path)
+{
+    STAT_TIMED(OS_OP_RMTREE);
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    if(_status.readOnly) return -1;
+    JOURNAL_OP();
+    dirEnt * p = _OS_getEnt(path);
+    if(p == NULL) return -1;
+    char * parent = _get_parent_path(path, NULL);
+    uint32_t top = p->dir_fstClusLO + ((uint32_t)p->dir_fstClusHI << 16);
+    int excode = 1;
+    if(parent == NULL || p->dir_name[0] == '.' || top == 0) excode = -1; // the root, "." or ".."
+    else if(!(p->dir_attr & 0x10)) excode = -2;
+    if(excode != 1) {
+        free(parent);
+        free(p);
+        return excode;
+    }
+
+    // every dir of the subtree, and the runs of every chain in it
+    int numDirs = 0, volDirs = 64, numRuns = 0, volRuns = 64;
+    uint32_t * dirs = malloc(volDirs * sizeof(uint32_t));
+    extent * runs = malloc(volRuns * sizeof(extent));
+    dirs[numDirs++] = top;
+    int d;
+    for(d = 0; d < numDirs; d++) {
+        int numExt = 0, n = 0, i;
+        extent * ext = _get_extents(dirs[d], 0, &numExt);
+        dirEnt * list = _read_dir_extents(ext, numExt, &n, NULL);
+        for(i = -1; i < n; i++) {
+            // i == -1 stands for the dir itself
+            uint32_t clus = i < 0 ? dirs[d] : list[i].dir_fstClusLO + ((uint32_t)list[i].dir_fstClusHI << 16);
+            if(clus == 0) continue;
+            if(i >= 0 && (list[i].dir_attr & 0x10)) {
+                if(numDirs == volDirs) dirs = realloc(dirs, (volDirs *= 2) * sizeof(uint32_t));
+                dirs[numDirs++] = clus;
+                continue;
+            }
+            int numChain = numExt;
+            extent * chain = i < 0 ? ext : _get_extents(clus, 0, &numChain);
+            while(numRuns + numChain > volRuns) runs = realloc(runs, (volRuns *= 2) * sizeof(extent));
+            memcpy(runs + numRuns, chain, numChain * sizeof(extent));
+            numRuns += numChain;
+            if(chain != ext) free(chain);
+        }
+        free(list);
+        free(ext);
+    }
+
+    // nothing below may be in use
+    qsort(dirs, numDirs, sizeof(uint32_t), _cmp_clus);
+    uint32_t cwd = _status.curdir->dir_fstClusLO + ((uint32_t)_status.curdir->dir_fstClusHI << 16);
+    if(bsearch(&cwd, dirs, numDirs, sizeof(uint32_t), _cmp_clus)) excode = -3;
+    int fd;
+    for(fd = 0; fd < _status.fdCap && excode == 1; fd++) {
+        openFile * of = _status.fdTable[fd];
+        if(of != NULL && bsearch(&of->parentClus, dirs, numDirs, sizeof(uint32_t), _cmp_clus)) excode = -3;
+    }
+
+    if(excode == 1) {
+        _delete_dirEnt(parent, p->dir_name);
+        _free_extents(runs, numRuns);
+    }
+    free(dirs);
+    free(runs);
+    free(parent);
+    free(p);
+    return excode;
+}
+
+/** copy the content of file @path to the host file @host_fd, starting at its current position
+ * every run of contiguous clusters is moved with a single in-kernel copy
+ * @return number of bytes exported, -1 if @path is invalid, -2 if it is a directory,
+ * -3 if the copy stopped early or open files could not be flushed. Files may be up to
+ * 4 GiB, so the count is 64-bit
+ */
+ssize_t OS_export(const char *path, int host_fd)
+{
+    STAT_TIMED(OS_OP_EXPORT);
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    // data open files still hold in memory goes to the device first, with their sizes
+    if(_flush_open()) return -3;
+    dirEnt * p = _OS_getEnt(path);
+    if(p == NULL) return -1;
+    if(p->dir_attr & 0x10) {
+        free(p);
+        return -2;
+    }
+    uint32_t remaining = p->dir_fileSize;
+    uint32_t numClus = (remaining + _status.BytesPerCluster - 1) / _status.BytesPerCluster;
+    uint32_t fstCluster = p->dir_fstClusLO + ((uint32_t)p->dir_fstClusHI << 16);
+    free(p);
+    if(numClus == 0) return 0;
+
+    int numExt = 0;
+    extent * ext = _get_extents(fstCluster, numClus, &numExt);
+    ssize_t excode = 0;
+    int i;
+    for(i = 0; i < numExt && remaining > 0; i++) {
+        size_t len = (size_t)ext[i].count * _status.BytesPerCluster;
+        if(len > remaining) len = remaining;
+        size_t copied = _copy_dev_to_fd(host_fd, _clusterPos(ext[i].start), len);
+        excode += copied;
+        remaining -= copied;
+        if(copied < len) break;
+    }
+    free(ext);
+    return remaining == 0 ? excode : -3;
+}
+
+/** create the file @path with the content of the host file @host_path
+ * the whole file is placed in one contiguous run of clusters reserved up front, or in
+ * the IMPORT_MAX_RUNS largest free runs when no run is large enough. The data is
+ * streamed with large cluster-aligned writes, then the FAT chain and the directory
+ * entry are committed once at the end
+ * @return number of bytes imported, -1 if a path is invalid or the host file is larger
+ * than 4 GiB - 1, -2 if @path already exists, -3 if the free space is too fragmented.
+ * Files may be up to 4 GiB, so the count is 64-bit
+ */
+ssize_t OS_import(const char *host_path, const char *path)
+{
+    STAT_TIMED(OS_OP_IMPORT);
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    if(_status.readOnly) return -1;
+    dirEnt * self_dirEnt = _OS_getEnt(path);
+    if(self_dirEnt != NULL) {
+        free(self_dirEnt);
+        return -2;
+    }
+    char filename_buffer[strlen(path) + 1];
+    dirEnt new_ent;
+    memset(&new_ent, 0, sizeof(dirEnt));
+    char * parentdir = _get_parent_path(path, filename_buffer);
+    if(!parentdir) return -1;
+    dirEnt * parent_dirEnt = _OS_getEnt(parentdir);
+    if(parent_dirEnt == NULL || !(parent_dirEnt->dir_attr & 0x10)
+       || strlen(filename_buffer) > 12 || flnm2FAT(filename_buffer, new_ent.dir_name)) {
+        free(parent_dirEnt);
+        free(parentdir);
+        return -1;
+    }
+    free(parent_dirEnt);
+
+    int host_fd = open(host_path, O_RDONLY);
+    struct stat st;
+    if(host_fd < 0 || fstat(host_fd, &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size > FAT32_MAX_FILE_SIZE) {
+        if(host_fd >= 0) close(host_fd);
+        free(parentdir);
+        return -1;
+    }
+
+    // an empty file owns no cluster, like the ones made by OS_creat
+    uint32_t numClus = (st.st_size + _status.BytesPerCluster - 1) / _status.BytesPerCluster;
+    extent runs[IMPORT_MAX_RUNS];
+    int numRuns = 0;
+    if(numClus > 0) {
+        runs[0].start = _findFreeRun(numClus);
+        runs[0].count = numClus;
+        numRuns = runs[0].start != 0 ? 1 : _findFreeRuns(numClus, runs, IMPORT_MAX_RUNS);
+        if(numRuns == 0) {
+            close(host_fd);
+            free(parentdir);
+            return -3;
+        }
+    }
+
+    // stream the data into the reserved runs
+    size_t chunk = COPY_CHUNK_SIZE - COPY_CHUNK_SIZE % _status.BytesPerCluster;
+    unsigned char * buf = malloc(chunk);
+    off_t done = 0;
+    int k;
+    for(k = 0; k < numRuns && done < st.st_size; k++) {
+        off_t runDone = 0, runBytes = (off_t)runs[k].count * _status.BytesPerCluster;
+        while(runDone < runBytes && done < st.st_size) {
+            ssize_t r = read(host_fd, buf, runBytes - runDone < (off_t)chunk ? (size_t)(runBytes - runDone) : chunk);
+            if(r <= 0) break;
+            if(_dev_write(buf, r, _clusterPos(runs[k].start) + runDone) != r) break;
+            runDone += r;
+            done += r;
+        }
+        if(runDone < runBytes && done < st.st_size) break;
+    }
+    free(buf);
+    close(host_fd);
+    if(done < st.st_size) {
+        free(parentdir);
+        return -1;
+    }
+
+    // commit the chain, then make the file visible; with FAT_FS_JOURNAL both are one logged update
+    JOURNAL_OP();
+    for(k = 0; k < numRuns; k++) {
+        _setFATchain(runs[k].start, runs[k].count);
+        if(k > 0) _setFATvalue(runs[k - 1].start + runs[k - 1].count - 1, runs[k].start);
+    }
+    uint32_t start = numRuns > 0 ? runs[0].start : 0;
+    new_ent.dir_attr = 0x20;
+    new_ent.dir_fstClusLO = start & 0xFFFF;
+    new_ent.dir_fstClusHI = start >> 16;
+    new_ent.dir_fileSize = st.st_size;
+    ssize_t excode = done;
+    if(_add_dirEnt(parentdir, &new_ent)) {
+        if(start != 0) _remove_link(start);
+        excode = -1;
+    }
+    free(parentdir);
+    return excode;
+}
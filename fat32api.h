@@ -6,15 +6,67 @@
 #define _FAT32API_H
 
 #include "fat16_32.h"
+#include "dev32.h"
 #include <stdbool.h>
-#define MAX_NUM_FILE 128
+
+/// first size of the fd table, which doubles whenever it is full
+#define FD_TABLE_MIN 128
+
+/// buckets of each hash table of the open files
+#define OPEN_BUCKETS 1024
 
 #define SIZE_FAT_ENTRY 4
 
+/// largest file size FAT32 can record
+#define FAT32_MAX_FILE_SIZE 0xFFFFFFFFULL
+
+/// delayed data of one fd is flushed once it reaches this size
+#define DELALLOC_MAX (8 << 20)
+
+/// clusters buffered per fd for small writes to a file that already has clusters
+#define WRITEBUF_CLUS 16
+
+/// most clusters added to a chain at once by the preallocation of appends
+#define PREALLOC_MAX_CLUS 1024
+
+/// how new clusters are chosen, set per mount by FAT_FS_PLACEMENT
+#define PLACE_FIRST 0 // the lowest free cluster ("first", the default)
+#define PLACE_NEAR 1  // near the parent dir or the previous cluster ("near")
+
+/// write state of an open file, shared by all its fds
 typedef struct {
-    dirEnt * openedFiles[MAX_NUM_FILE];
-    dirEnt * openedFilesParent[MAX_NUM_FILE];
-    int device_fd; // the file descriptor of the device file
+    unsigned char * buf; // data not yet on the device, for the file range bufOff .. bufOff + bufLen
+    uint32_t bufOff;     // always 0 for a file with no cluster yet (delayed allocation)
+    uint32_t bufLen;
+    uint32_t bufVol;     // allocated size of buf
+    uint32_t diskSize;   // file size as written on the device, dir_fileSize may be larger
+    uint32_t chainLen;   // clusters in the chain, 0 until _chain_load
+    uint32_t lastClus;   // last cluster of the chain
+    uint32_t tailClus;   // cluster number tailIdx of the chain, where appends start walking
+    uint32_t tailIdx;
+    bool preallocated;   // the chain may reach past the data
+} fileState;
+
+/// a file opened at least once, every fd of the file points to the same object
+typedef struct openFile {
+    dirEnt ent;                 // the entry, sizes written through any fd show in all of them
+    uint32_t parentClus;        // first cluster of the dir holding the entry (root is not 0)
+    off_t slotPos;              // device position of the entry, 0 until it is looked up
+    fileState st;
+    int refs;                   // fds pointing here
+    struct openFile * nextClus; // in its bucket of openByClus, once the file has a cluster
+    struct openFile * nextSlot; // in its bucket of openBySlot
+} openFile;
+
+typedef struct {
+    openFile ** fdTable;        // fdCap slots, NULL for a free fd
+    int * fdFree;               // stack of the free fds
+    int fdCap;
+    int numFree;
+    openFile * openByClus[OPEN_BUCKETS]; // open files by first cluster
+    openFile * openBySlot[OPEN_BUCKETS]; // open files by parent dir and name, new files have no cluster yet
+    int device_fd; // the file descriptor of the device file, -1 for the ram backend
+    const devBackend * dev; // where the volume lives, chosen by FAT_FS_BACKEND
     dirEnt * curdir; // points to a
     bool initialized;
     unsigned int BytesPerSec;
@@ -23,11 +75,17 @@ typedef struct {
     unsigned int startDataSec;
     unsigned int idxRootDirClus;
     unsigned int FATSz; // size of ONE FAT in sectors
+    unsigned int totalClus; // number of valid FAT entries (data clusters + the 2 reserved ones)
     short numFAT;
+    short placement; // PLACE_FIRST or PLACE_NEAR
+    bool readOnly; // set per mount by FAT_FS_READONLY, calls that would change the volume fail
+    uint32_t volID;      // BS_VolID
 } DriverStatus;
 
 extern DriverStatus _status;
 
 void _OS_initialization();
 
+void _OS_finalization();
+
 #endif
@@ -0,0 +1,334 @@
+/*
+ * Consistency checker for the FAT32 API
+ *
+ * OS_fsck(const fsckParam *param, fsckReport *report): check (and optionally repair)
+ *   the mounted volume
+ *
+ * The first FAT is loaded into memory once. The directory tree is then walked by a
+ * pool of threads; every chain found is followed in the in-memory FAT and each of its
+ * clusters is claimed in a shared bitmap with an atomic test-and-set, so a cluster
+ * claimed twice is a cross-link. Clusters in use in the FAT but never claimed are lost.
+ * A chain that is cut short still gives its valid prefix, and a dir is scanned as far
+ * as that prefix goes.
+ */
+
+#include "fat16_32.h"
+#include "fat32api.h"
+#include "utils32.h"
+#include "stats32.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+/// a directory waiting to be scanned
+typedef struct fsckDir {
+    extent * ext;
+    int numExt;
+    char * path;
+    struct fsckDir * next;
+} fsckDir;
+
+typedef struct {
+    const fsckParam * param;
+    fsckReport * report;
+    uint32_t * fat;        // the first FAT, totalClus entries
+    uint64_t * owned;      // one bit per cluster, set once a chain claims it
+    uint8_t * dirtySec;    // FAT sectors changed by the repair
+    pthread_mutex_t lock;  // protects the queue and the log
+    pthread_cond_t cond;
+    fsckDir * queue;
+    int busy;              // workers scanning a dir right now
+    bool incomplete;       // a chain was cut short, what it led to may look lost
+} fsckState;
+
+/// how a claimed chain ended
+#define CHAIN_END 0        // with an EOC mark
+#define CHAIN_BAD 1        // in a free or out of range cluster
+#define CHAIN_CROSSED 2    // in a cluster claimed by another chain
+
+#define REPORT_ADD(st, field) __atomic_fetch_add(&(st)->report->field, 1, __ATOMIC_RELAXED)
+
+static void _fsck_log(fsckState * st, const char * path, const uint8_t * name, const char * msg) {
+    if(st->param->logFd < 0) return;
+    char flnm[13] = "";
+    if(name) _FAT2flnm(name, flnm);
+    pthread_mutex_lock(&st->lock);
+    dprintf(st->param->logFd, "%s/%s: %s\n", path, flnm, msg);
+    pthread_mutex_unlock(&st->lock);
+}
+
+/// set the in-memory FAT entry @idx and remember its sector for the write back
+static void _fsck_set(fsckState * st, uint32_t idx, uint32_t value) {
+    st->fat[idx] = (st->fat[idx] & 0xF0000000) + value;
+    st->dirtySec[idx / (_status.BytesPerSec / SIZE_FAT_ENTRY)] = 1;
+}
+
+/**
+ * claim the chain starting at @start for the entry @name in dir @path
+ * @return the runs of the chain (caller frees) up to the first cluster that is out of
+ * range, free, or already claimed; *length receives the number of clusters, *end how
+ * the chain ended (CHAIN_*)
+ */
+static extent * _fsck_claim(fsckState * st, uint32_t start, const char * path, const uint8_t * name,
+                            uint32_t * length, int * numExt, int * end) {
+    int vol = 4;
+    extent * ext = malloc(vol * sizeof(extent));
+    uint32_t cur = start;
+    *numExt = 0;
+    *length = 0;
+    *end = CHAIN_END;
+    while(true) {
+        if(cur < 2 || cur >= _status.totalClus || (st->fat[cur] & 0x0FFFFFFF) == 0) {
+            REPORT_ADD(st, badChains);
+            _fsck_log(st, path, name, "chain points to a free or invalid cluster");
+            *end = CHAIN_BAD;
+            break;
+        }
+        uint64_t bit = 1ULL << (cur % 64);
+        if(__atomic_fetch_or(&st->owned[cur / 64], bit, __ATOMIC_RELAXED) & bit) {
+            REPORT_ADD(st, crossLinked);
+            _fsck_log(st, path, name, "chain is cross-linked with another chain");
+            *end = CHAIN_CROSSED;
+            break;
+        }
+        if(*numExt > 0 && ext[*numExt - 1].start + ext[*numExt - 1].count == cur) {
+            ext[*numExt - 1].count++;
+        } else {
+            if(*numExt == vol) {
+                vol *= 2;
+                ext = realloc(ext, vol * sizeof(extent));
+            }
+            ext[*numExt].start = cur;
+            ext[*numExt].count = 1;
+            (*numExt)++;
+        }
+        (*length)++;
+        uint32_t next = st->fat[cur] & 0x0FFFFFFF;
+        if(next >= 0x0FFFFFF8) break;
+        cur = next;
+    }
+    if(*end != CHAIN_END) __atomic_store_n(&st->incomplete, true, __ATOMIC_RELAXED);
+    return ext;
+}
+
+/// the cluster at position @k of the chain @ext
+static uint32_t _fsck_nth(const extent * ext, uint32_t k) {
+    int e = 0;
+    while(k >= ext[e].count) k -= ext[e++].count;
+    return ext[e].start + k;
+}
+
+/// check every entry of @dir and queue its sub dirs
+static void _fsck_scan(fsckState * st, fsckDir * dir) {
+    int n = 0;
+    off_t * slotPos = NULL;
+    dirEnt * list = _read_dir_extents(dir->ext, dir->numExt, &n, &slotPos);
+    int i;
+    for(i = 0; i < n; i++) {
+        dirEnt * ent = &list[i];
+        uint32_t start = ent->dir_fstClusLO + ((uint32_t)ent->dir_fstClusHI << 16);
+        bool isDir = ent->dir_attr & 0x10;
+        if(isDir) REPORT_ADD(st, dirs);
+        else REPORT_ADD(st, files);
+        if(start == 0) {
+            // an empty file may own no cluster at all
+            if(isDir || ent->dir_fileSize > 0) {
+                REPORT_ADD(st, sizeMismatch);
+                _fsck_log(st, dir->path, ent->dir_name, "has data but no cluster");
+            }
+            continue;
+        }
+        uint32_t length = 0;
+        int numExt = 0;
+        int end;
+        extent * ext = _fsck_claim(st, start, dir->path, ent->dir_name, &length, &numExt, &end);
+        if(end == CHAIN_BAD && st->param->repair) {
+            // end the chain after its valid prefix, a file without one is left empty
+            if(length > 0) {
+                _fsck_set(st, _fsck_nth(ext, length - 1), 0x0FFFFFFF);
+                REPORT_ADD(st, repaired);
+            } else if(!isDir) {
+                ent->dir_fstClusLO = 0;
+                ent->dir_fstClusHI = 0;
+                ent->dir_fileSize = 0;
+                _dev_write(ent, sizeof(dirEnt), slotPos[i]);
+                REPORT_ADD(st, repaired);
+            }
+        }
+        if(!isDir && end != CHAIN_CROSSED && length > 0) {
+            uint32_t need = (ent->dir_fileSize + _status.BytesPerCluster - 1) / _status.BytesPerCluster;
+            // an empty file may still own one cluster, as OS_creat gave them before delayed allocation
+            if(length < need || length > (need == 0 ? 1 : need)) {
+                REPORT_ADD(st, sizeMismatch);
+                _fsck_log(st, dir->path, ent->dir_name, "size does not match the chain length");
+                if(st->param->repair && length > need && need > 0) {
+                    // drop the tail beyond the size, its clusters show up as lost
+                    uint32_t last = _fsck_nth(ext, need - 1);
+                    uint32_t k = need;
+                    for( ; k < length; k++) {
+                        uint32_t c = _fsck_nth(ext, k);
+                        __atomic_fetch_and(&st->owned[c / 64], ~(1ULL << (c % 64)), __ATOMIC_RELAXED);
+                    }
+                    _fsck_set(st, last, 0x0FFFFFFF);
+                    REPORT_ADD(st, repaired);
+                } else if(st->param->repair && length < need) {
+                    // keep the data we have
+                    ent->dir_fileSize = length * _status.BytesPerCluster;
+                    _dev_write(ent, sizeof(dirEnt), slotPos[i]);
+                    REPORT_ADD(st, repaired);
+                }
+            }
+        }
+        if(isDir && length > 0) {
+            fsckDir * sub = malloc(sizeof(fsckDir));
+            char name[13];
+            _FAT2flnm(ent->dir_name, name);
+            sub->ext = ext;
+            sub->numExt = numExt;
+            sub->path = malloc(strlen(dir->path) + strlen(name) + 2);
+            sprintf(sub->path, "%s/%s", dir->path, name);
+            pthread_mutex_lock(&st->lock);
+            sub->next = st->queue;
+            st->queue = sub;
+            pthread_cond_signal(&st->cond);
+            pthread_mutex_unlock(&st->lock);
+        } else {
+            free(ext);
+        }
+    }
+    free(slotPos);
+    free(list);
+}
+
+static void * _fsck_worker(void * arg) {
+    fsckState * st = arg;
+    pthread_mutex_lock(&st->lock);
+    while(true) {
+        while(st->queue == NULL && st->busy > 0) pthread_cond_wait(&st->cond, &st->lock);
+        if(st->queue == NULL) break; // nothing queued and nobody can queue more
+        fsckDir * dir = st->queue;
+        st->queue = dir->next;
+        st->busy++;
+        pthread_mutex_unlock(&st->lock);
+        _fsck_scan(st, dir);
+        free(dir->ext);
+        free(dir->path);
+        free(dir);
+        pthread_mutex_lock(&st->lock);
+        st->busy--;
+        if(st->busy == 0 && st->queue == NULL) pthread_cond_broadcast(&st->cond);
+    }
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+/** check the mounted volume: cross-linked chains, chains into free clusters, lost
+ * clusters, sizes that do not match their chain and FAT copies that differ.
+ * with @param->repair, chains into free clusters end after their last valid cluster,
+ * chains longer than their file are cut, sizes beyond the chain are reduced and every
+ * FAT copy is rewritten from the first one. lost clusters are freed only if no chain was
+ * cut short: the clusters it led to may be data of a file, a second run frees them once
+ * the chains are whole. cross-links are only reported, as are dirs with no valid cluster
+ * @return 0 if the volume is clean, 1 if problems were found, -1 if the FAT cannot be
+ * read, -2 if a repair was asked on a read-only mount or while files are open
+ */
+int OS_fsck(const fsckParam *param, fsckReport *report)
+{
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    memset(report, 0, sizeof(fsckReport));
+    // the repair writes entries and FAT sectors behind the back of the open files
+    if(param->repair && (_status.readOnly || _status.numFree < _status.fdCap)) return -2;
+    fsckState st;
+    memset(&st, 0, sizeof(st));
+    st.param = param;
+    st.report = report;
+    const uint32_t entPerSec = _status.BytesPerSec / SIZE_FAT_ENTRY;
+    uint32_t numSec = (_status.totalClus + entPerSec - 1) / entPerSec;
+    size_t fatBytes = (size_t)numSec * _status.BytesPerSec;
+    off_t fatPos = (off_t)_status.startFATSec * _status.BytesPerSec;
+    st.fat = malloc(fatBytes);
+    if(st.fat == NULL || _dev_read(st.fat, fatBytes, fatPos) != fatBytes) {
+        free(st.fat);
+        return -1;
+    }
+    st.owned = calloc((_status.totalClus + 63) / 64, sizeof(uint64_t));
+    st.dirtySec = calloc(numSec, 1);
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+
+    // the FAT copies must agree on every entry that maps a cluster
+    uint32_t * mirror = malloc(fatBytes);
+    bool mirrorDiffers = false;
+    int f;
+    for(f = 1; f < _status.numFAT; f++) {
+        _dev_read(mirror, fatBytes, fatPos + (off_t)f * _status.FATSz * _status.BytesPerSec);
+        uint32_t k;
+        for(k = 0; k < _status.totalClus; k++)
+            if((mirror[k] & 0x0FFFFFFF) != (st.fat[k] & 0x0FFFFFFF)) report->mirrorDiffs++;
+    }
+    free(mirror);
+    if(report->mirrorDiffs > 0) {
+        mirrorDiffers = true;
+        if(param->logFd >= 0) dprintf(param->logFd, "%lu FAT entries differ between the FAT copies\n",
+                                      report->mirrorDiffs);
+    }
+
+    // the root dir is the only chain not found in a dir entry
+    fsckDir * root = malloc(sizeof(fsckDir));
+    uint32_t length;
+    int end;
+    root->ext = _fsck_claim(&st, _status.idxRootDirClus, "", NULL, &length, &root->numExt, &end);
+    root->path = strdup("");
+    root->next = NULL;
+    st.queue = root;
+
+    int threads = param->threads > 0 ? param->threads : 1;
+    pthread_t * workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for( ; started < threads - 1; started++)
+        if(pthread_create(&workers[started], NULL, _fsck_worker, &st) != 0) break;
+    _fsck_worker(&st);
+    int i;
+    for(i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+
+    uint32_t k;
+    for(k = 2; k < _status.totalClus; k++) {
+        uint32_t v = st.fat[k] & 0x0FFFFFFF;
+        if(v == 0 || v == 0x0FFFFFF7) continue; // free or marked bad
+        if(st.owned[k / 64] & (1ULL << (k % 64))) continue;
+        report->lostClusters++;
+        if(param->repair && !st.incomplete) {
+            _fsck_set(&st, k, 0);
+            report->repaired++;
+        }
+    }
+    if(report->lostClusters > 0 && param->logFd >= 0)
+        dprintf(param->logFd, "%lu lost clusters%s\n", report->lostClusters,
+                param->repair && st.incomplete ? ", kept as some chains were cut short" : "");
+
+    if(param->repair) {
+        // write back changed sectors to every copy, or the whole FAT if the copies differ
+        uint32_t sec;
+        for(sec = 0; sec < numSec; sec++) {
+            if(!st.dirtySec[sec] && !mirrorDiffers) continue;
+            for(f = 0; f < _status.numFAT; f++) {
+                if(f == 0 && !st.dirtySec[sec]) continue;
+                _dev_write((uint8_t *)st.fat + (size_t)sec * _status.BytesPerSec, _status.BytesPerSec,
+                           fatPos + ((off_t)f * _status.FATSz + sec) * _status.BytesPerSec);
+            }
+        }
+        if(mirrorDiffers) report->repaired++;
+    }
+
+    pthread_mutex_destroy(&st.lock);
+    pthread_cond_destroy(&st.cond);
+    free(st.fat);
+    free(st.owned);
+    free(st.dirtySec);
+    bool dirty = report->crossLinked || report->badChains || report->lostClusters
+        || report->sizeMismatch || report->mirrorDiffs;
+    return dirty ? 1 : 0;
+}
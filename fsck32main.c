@@ -0,0 +1,46 @@
+/*
+ fsck32: check a FAT32 image
+ Usage: fsck32 [-r] [-j threads] image
+   -r  repair what can be repaired
+*/
+#include "fat16_32.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+    fsckParam param = {1, false, 1};
+    int opt;
+    while((opt = getopt(argc, argv, "rj:")) != -1) {
+        switch(opt) {
+            case 'r': param.repair = true; break;
+            case 'j': param.threads = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-r] [-j threads] image\n", argv[0]);
+                return 2;
+        }
+    }
+    if(argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-r] [-j threads] image\n", argv[0]);
+        return 2;
+    }
+    if(access(argv[optind], R_OK | (param.repair ? W_OK : 0)) != 0) {
+        perror(argv[optind]);
+        return 2;
+    }
+    setenv("FAT_FS_PATH", argv[optind], 1);
+    fsckReport report;
+    int status = OS_fsck(&param, &report);
+    if(status < 0) {
+        fprintf(stderr, status == -2 ? "cannot repair a read-only or busy volume\n" : "cannot read the FAT\n");
+        return 2;
+    }
+    printf("%lu dirs, %lu files\n", report.dirs, report.files);
+    printf("cross-linked: %lu, bad chains: %lu, lost clusters: %lu, size mismatches: %lu, "
+           "FAT copy differences: %lu\n", report.crossLinked, report.badChains,
+           report.lostClusters, report.sizeMismatch, report.mirrorDiffs);
+    if(param.repair) printf("repaired: %lu\n", report.repaired);
+    return status;
+}
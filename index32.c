@@ -0,0 +1,357 @@
+/*
+ * Namespace index for read-only mounts of the FAT32 API
+ *
+ * A mount with FAT_FS_READONLY=1 cannot change the volume, so its tree only has to be
+ * read once. At mount a background thread lists every dir and builds an index of:
+ *  - every entry (name, attributes, size, first cluster) with the first cluster of its
+ *    dir, sorted by dir and name, so the entries of a dir form one range that is
+ *    searched by bisection
+ *  - the runs of every chain (files, dirs and the root dir), sorted by first cluster
+ * The finished index is published with one atomic store and never changes again, so
+ * _OS_getEnt and _get_extents use it without locks and without device I/O. Until then
+ * they read the device as on any other mount.
+ *
+ * With FAT_FS_INDEX=<file> the index is also kept in that sidecar file: an indexFileHeader
+ * followed by the three arrays as they are in memory. The header carries what any writer
+ * of the volume changes, taken before the tree was listed: the size and modification time
+ * of the image file (or block device) and the free count and next free cluster of the
+ * FSInfo sector, with the volume ID and a checksum of the arrays. A later read-only mount
+ * maps a sidecar that still matches and uses it in place, without listing a single dir; a
+ * sidecar that does not match is rebuilt and replaced. Nothing is written to the volume.
+ * Only the namespace is kept: mounts that write search the FAT for free clusters on the
+ * device and keep no FAT or free map in memory that could be saved.
+ */
+
+#include "fat16_32.h"
+#include "fat32api.h"
+#include "utils32.h"
+#include "index32.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/// an entry of the tree and the dir holding it
+typedef struct {
+    dirEnt ent;
+    uint32_t parentClus;  // the root dir is idxRootDirClus, not 0
+} indexEnt;
+
+/// the runs of one chain, exts[firstExt .. firstExt + numExt - 1]
+typedef struct {
+    uint32_t clus;
+    uint32_t firstExt;
+    uint32_t numExt;
+    int32_t owner;        // entry of ents the chain belongs to, -1 for the root dir
+} indexChain;
+
+typedef struct {
+    indexEnt * ents;      // sorted by parentClus, then dir_name
+    uint32_t numEnts;
+    indexChain * chains;  // sorted by clus
+    uint32_t numChains;
+    extent * exts;
+    uint32_t numExts;
+    void * map;           // the sidecar holding the arrays, NULL if they were built here
+    size_t mapLen;
+} nsIndex;
+
+/// head of a sidecar file, followed by ents, chains and exts
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t volID;       // BS_VolID of the volume
+    int64_t imageSize;    // FAT_FS_PATH when the tree was listed: size in bytes,
+    int64_t mtimeSec;     // modification time
+    int64_t mtimeNsec;
+    uint32_t freeCount;   // FSInfo free cluster count and next free cluster
+    uint32_t nextFree;
+    uint32_t numEnts;
+    uint32_t numChains;
+    uint32_t numExts;
+    uint32_t reserved;
+    uint64_t checksum;    // FNV-1a of the arrays
+} indexFileHeader;
+
+static nsIndex * _index = NULL;
+static pthread_t _indexThread;
+static bool _indexRunning = false;
+static char * _sidecar = NULL;
+static indexFileHeader _volume; // the state of the volume the index is built from
+
+/// fill the fields of @h that any writer of the volume changes
+static void _index_identity(indexFileHeader * h) {
+    memset(h, 0, sizeof(indexFileHeader));
+    h->volID = _status.volID;
+    const char * image = getenv("FAT_FS_PATH");
+    struct stat sb;
+    if(image != NULL && stat(image, &sb) == 0) {
+        h->imageSize = sb.st_size;
+        h->mtimeSec = sb.st_mtim.tv_sec;
+        h->mtimeNsec = sb.st_mtim.tv_nsec;
+    }
+    uint16_t fsInfo = 0;
+    uint32_t counts[2] = {0, 0}; // FSI_Free_Count at 488, FSI_Nxt_Free at 492
+    if(_dev_read_raw(&fsInfo, sizeof(fsInfo), offsetof(FAT32_BPB, FSInfo)) == sizeof(fsInfo) && fsInfo != 0)
+        _dev_read_raw(counts, sizeof(counts), (off_t)fsInfo * _status.BytesPerSec + 488);
+    h->freeCount = counts[0];
+    h->nextFree = counts[1];
+}
+
+/// FNV-1a of @n bytes at @p, continuing from @h (0xcbf29ce484222325 to start)
+static uint64_t _index_checksum(uint64_t h, const unsigned char * p, size_t n) {
+    size_t i;
+    for(i = 0; i < n; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+/**
+ * map the sidecar @path and check it was built from the volume as it is now
+ * @return the index in the mapping, NULL if there is no usable sidecar
+ */
+static nsIndex * _index_load(const char * path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+    struct stat sb;
+    void * map = MAP_FAILED;
+    if(fstat(fd, &sb) == 0 && (size_t)sb.st_size >= sizeof(indexFileHeader))
+        map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) return NULL;
+    const indexFileHeader * h = map;
+    size_t body = (size_t)h->numEnts * sizeof(indexEnt) + (size_t)h->numChains * sizeof(indexChain)
+        + (size_t)h->numExts * sizeof(extent);
+    if(memcmp(h->magic, INDEX_MAGIC, 8) != 0 || h->version != INDEX_VERSION || h->volID != _volume.volID
+       || h->imageSize != _volume.imageSize || h->mtimeSec != _volume.mtimeSec || h->mtimeNsec != _volume.mtimeNsec
+       || h->freeCount != _volume.freeCount || h->nextFree != _volume.nextFree
+       || sizeof(indexFileHeader) + body != (size_t)sb.st_size
+       || _index_checksum(0xcbf29ce484222325ULL, (const unsigned char *)map + sizeof(indexFileHeader), body) != h->checksum) {
+        munmap(map, sb.st_size);
+        return NULL;
+    }
+    nsIndex * ix = calloc(1, sizeof(nsIndex));
+    ix->map = map;
+    ix->mapLen = sb.st_size;
+    ix->numEnts = h->numEnts;
+    ix->numChains = h->numChains;
+    ix->numExts = h->numExts;
+    ix->ents = (indexEnt *)((char *)map + sizeof(indexFileHeader));
+    ix->chains = (indexChain *)(ix->ents + ix->numEnts);
+    ix->exts = (extent *)(ix->chains + ix->numChains);
+    return ix;
+}
+
+/// write @ix to the sidecar @path, replacing the old one at once
+static void _index_save(const nsIndex * ix, const char * path) {
+    size_t len = strlen(path) + 5;
+    char tmp[len];
+    snprintf(tmp, len, "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return;
+    size_t sizes[3] = {ix->numEnts * sizeof(indexEnt), ix->numChains * sizeof(indexChain),
+                       ix->numExts * sizeof(extent)};
+    const void * parts[3] = {ix->ents, ix->chains, ix->exts};
+    indexFileHeader h = _volume;
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.version = INDEX_VERSION;
+    h.numEnts = ix->numEnts;
+    h.numChains = ix->numChains;
+    h.numExts = ix->numExts;
+    h.checksum = 0xcbf29ce484222325ULL;
+    int i;
+    for(i = 0; i < 3; i++) h.checksum = _index_checksum(h.checksum, parts[i], sizes[i]);
+    bool ok = write(fd, &h, sizeof(h)) == sizeof(h);
+    for(i = 0; i < 3 && ok; i++) ok = write(fd, parts[i], sizes[i]) == (ssize_t)sizes[i];
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if(!ok || rename(tmp, path) != 0) unlink(tmp);
+}
+
+static int _index_cmpEnt(const void * a, const void * b) {
+    const indexEnt * x = a, * y = b;
+    if(x->parentClus != y->parentClus) return x->parentClus < y->parentClus ? -1 : 1;
+    return memcmp(x->ent.dir_name, y->ent.dir_name, 11);
+}
+
+static int _index_cmpChain(const void * a, const void * b) {
+    const indexChain * x = a, * y = b;
+    return x->clus < y->clus ? -1 : x->clus > y->clus;
+}
+
+/// list every dir from the root down, then the chain of the root and of every entry
+static void * _index_build(void * arg) {
+    (void)arg;
+    nsIndex * ix = calloc(1, sizeof(nsIndex));
+    uint32_t volEnts = 64, volExts = 64;
+    ix->ents = malloc(volEnts * sizeof(indexEnt));
+    ix->exts = malloc(volExts * sizeof(extent));
+    // the dirs to list are the dir entries found so far, in order; a cross-linked tree
+    // could list a dir twice, the number of dirs listed is bounded by the volume
+    uint32_t next = 0, listed = 0;
+    uint32_t dirClus = _status.idxRootDirClus;
+    while(listed++ < _status.totalClus) {
+        int n = 0;
+        dirEnt * list = _read_dir_clus(dirClus, &n);
+        int i;
+        for(i = 0; i < n; i++) {
+            if(ix->numEnts == volEnts) {
+                volEnts *= 2;
+                ix->ents = realloc(ix->ents, volEnts * sizeof(indexEnt));
+            }
+            ix->ents[ix->numEnts].ent = list[i];
+            ix->ents[ix->numEnts].parentClus = dirClus;
+            ix->numEnts++;
+        }
+        free(list);
+        dirClus = 0;
+        for( ; next < ix->numEnts && dirClus == 0; next++) {
+            if(ix->ents[next].ent.dir_attr & 0x10)
+                dirClus = ix->ents[next].ent.dir_fstClusLO + ((uint32_t)ix->ents[next].ent.dir_fstClusHI << 16);
+        }
+        if(dirClus == 0) break;
+    }
+    qsort(ix->ents, ix->numEnts, sizeof(indexEnt), _index_cmpEnt);
+
+    ix->chains = malloc((ix->numEnts + 1) * sizeof(indexChain));
+    ix->chains[ix->numChains++] = (indexChain){_status.idxRootDirClus, 0, 0, -1};
+    uint32_t k;
+    for(k = 0; k < ix->numEnts; k++) {
+        uint32_t clus = ix->ents[k].ent.dir_fstClusLO + ((uint32_t)ix->ents[k].ent.dir_fstClusHI << 16);
+        if(clus != 0) ix->chains[ix->numChains++] = (indexChain){clus, 0, 0, (int32_t)k};
+    }
+    qsort(ix->chains, ix->numChains, sizeof(indexChain), _index_cmpChain);
+    uint32_t numExt = 0, kept = 0;
+    for(k = 0; k < ix->numChains; k++) {
+        if(kept > 0 && ix->chains[kept - 1].clus == ix->chains[k].clus) continue; // cross-linked
+        indexChain * c = &ix->chains[kept++];
+        *c = ix->chains[k];
+        int n = 0;
+        extent * ext = _get_extents(c->clus, 0, &n);
+        while(numExt + n > volExts) {
+            volExts *= 2;
+            ix->exts = realloc(ix->exts, volExts * sizeof(extent));
+        }
+        memcpy(ix->exts + numExt, ext, n * sizeof(extent));
+        c->firstExt = numExt;
+        c->numExt = n;
+        numExt += n;
+        free(ext);
+    }
+    ix->numChains = kept;
+    ix->numExts = numExt;
+    __atomic_store_n(&_index, ix, __ATOMIC_RELEASE);
+    if(_sidecar != NULL) _index_save(ix, _sidecar);
+    return NULL;
+}
+
+void _index_start(const char * sidecar) {
+    free(_sidecar);
+    _sidecar = sidecar ? strdup(sidecar) : NULL;
+    if(_sidecar != NULL) _index_identity(&_volume);
+    nsIndex * ix = _sidecar ? _index_load(_sidecar) : NULL;
+    if(ix != NULL) {
+        __atomic_store_n(&_index, ix, __ATOMIC_RELEASE);
+        return;
+    }
+    _indexRunning = pthread_create(&_indexThread, NULL, _index_build, NULL) == 0;
+    static bool registered = false; // a short-lived program still leaves its sidecar behind
+    if(_indexRunning && _sidecar != NULL && !registered) registered = atexit(_index_stop) == 0;
+}
+
+void _index_stop() {
+    if(_indexRunning) pthread_join(_indexThread, NULL);
+    _indexRunning = false;
+    nsIndex * ix = _index;
+    _index = NULL;
+    if(ix == NULL) return;
+    if(ix->map != NULL) {
+        munmap(ix->map, ix->mapLen);
+    } else {
+        free(ix->ents);
+        free(ix->chains);
+        free(ix->exts);
+    }
+    free(ix);
+}
+
+static const indexChain * _index_chain(const nsIndex * ix, uint32_t clus) {
+    indexChain key = {clus, 0, 0, 0};
+    return bsearch(&key, ix->chains, ix->numChains, sizeof(indexChain), _index_cmpChain);
+}
+
+/// the entry named @name in the dir at @dirClus, matched like _OS_getEnt does
+static const indexEnt * _index_find(const nsIndex * ix, uint32_t dirClus, char * name) {
+    indexEnt key;
+    unsigned char fatName[12];
+    if(strlen(name) > 12 || flnm2FAT(name, fatName)) return NULL;
+    memcpy(key.ent.dir_name, fatName, 11);
+    key.parentClus = dirClus;
+    uint32_t lo = 0, hi = ix->numEnts;
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(_index_cmpEnt(&ix->ents[mid], &key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if(lo < ix->numEnts && ix->ents[lo].parentClus == dirClus && !verify(ix->ents[lo].ent.dir_name, name))
+        return &ix->ents[lo];
+    return NULL;
+}
+
+int _index_getEnt(const char * path, dirEnt * out) {
+    const nsIndex * ix = __atomic_load_n(&_index, __ATOMIC_ACQUIRE);
+    if(ix == NULL) return -1;
+    dirEnt cur;
+    if(path[0] == '/') _initVirtualRootDirEnt(&cur);
+    else cur = *_status.curdir;
+    const char * p = path;
+    while(*p == '/') p++;
+    while(*p != '\0') {
+        size_t len = strcspn(p, "/");
+        char name[16];
+        if(len >= sizeof(name)) return 0;
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+        while(*p == '/') p++;
+        if(strcmp(name, ".") == 0) continue;
+        if(!(cur.dir_attr & 0x10)) return 0;
+        uint32_t dirClus = cur.dir_fstClusLO + ((uint32_t)cur.dir_fstClusHI << 16);
+        if(dirClus == 0) dirClus = _status.idxRootDirClus;
+        if(strcmp(name, "..") == 0) {
+            // the dir of the entry of this dir, the root dir is its own parent
+            const indexChain * c = _index_chain(ix, dirClus);
+            if(c == NULL || c->owner < 0) continue;
+            uint32_t parentClus = ix->ents[c->owner].parentClus;
+            const indexChain * pc = _index_chain(ix, parentClus);
+            if(pc == NULL || pc->owner < 0) _initVirtualRootDirEnt(&cur);
+            else cur = ix->ents[pc->owner].ent;
+            continue;
+        }
+        const indexEnt * e = _index_find(ix, dirClus, name);
+        if(e == NULL) return 0;
+        cur = e->ent;
+    }
+    *out = cur;
+    return 1;
+}
+
+extent * _index_extents(uint32_t idxCluster, uint32_t maxClus, int * n) {
+    const nsIndex * ix = __atomic_load_n(&_index, __ATOMIC_ACQUIRE);
+    if(ix == NULL) return NULL;
+    const indexChain * c = _index_chain(ix, idxCluster);
+    if(c == NULL) return NULL;
+    extent * res = malloc((c->numExt ? c->numExt : 1) * sizeof(extent));
+    uint32_t total = 0;
+    *n = 0;
+    // the same runs _get_extents would return for at most @maxClus clusters
+    while(*n < (int)c->numExt && (maxClus == 0 || total < maxClus)) {
+        res[*n] = ix->exts[c->firstExt + *n];
+        if(maxClus != 0 && total + res[*n].count > maxClus) res[*n].count = maxClus - total;
+        total += res[(*n)++].count;
+    }
+    return res;
+}
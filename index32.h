@@ -0,0 +1,31 @@
+/**
+ Header file for the namespace index of read-only mounts of the FAT32 API
+ */
+
+#ifndef _INDEX32_H
+#define _INDEX32_H
+
+#include "fat16_32.h"
+#include "utils32.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define INDEX_MAGIC "FAT32IDX"
+#define INDEX_VERSION 1
+
+/// map the index from the sidecar file @sidecar if it is still valid, otherwise build it in the background (and save it there)
+void _index_start(const char * sidecar);
+
+/// wait for the build and drop the index
+void _index_stop();
+
+/**
+ look @path up in the index
+ return 1 and the entry in @out if found, 0 if there is no such entry, -1 if the index is not built yet
+ */
+int _index_getEnt(const char * path, dirEnt * out);
+
+/// the runs of the chain at @idxCluster (see _get_extents), NULL if the index does not have it
+extent * _index_extents(uint32_t idxCluster, uint32_t maxClus, int * n);
+
+#endif
@@ -0,0 +1,373 @@
+/*
+ * Intent log for the metadata updates of the FAT32 API
+ *
+ * OS_sync(): commit the metadata updates logged so far
+ *
+ * The log is enabled per mount with FAT_FS_JOURNAL=<log file>. Device writes made by
+ * the calls marked with JOURNAL_OP (the OS_* calls that change directories or the FAT, and
+ * the final FAT and entry updates of OS_import and OS_build_image, whose data goes to the
+ * device before) do not reach the device: the sectors they change are kept in memory,
+ * where _dev_read finds them.
+ * Once JOURNAL_GROUP_OPS calls are done, or on OS_sync, OS_fsync and unmount, the
+ * changed sectors of all of them are appended to the log as one record and the log is
+ * flushed once (group commit). When the log passes JOURNAL_CKPT_BYTES the sectors are
+ * written in place, the device is flushed and the log is emptied (checkpoint). On mount
+ * the complete records are replayed, so after a crash every committed call is on the
+ * volume entirely and no call is on it in part. Every record names the volume it was
+ * written for, the records of a log left by another volume are not replayed.
+ *
+ * Other device writes (file data, sizes) are not logged and go to the device. One that
+ * overlaps a held sector also updates it and commits it first, after a device flush, so
+ * a replay never puts an older copy of the sector back over the write. Clusters freed by
+ * the uncommitted group are not handed out to unlogged writes either: the group is
+ * committed before such an allocation, so a replay cannot bring back a removed file on
+ * clusters that hold new data. OS_defrag is not logged: it copies data and orders its
+ * FAT and entry updates with device flushes itself (see defrag32.c).
+ */
+
+#include "fat16_32.h"
+#include "fat32api.h"
+#include "utils32.h"
+#include "stats32.h"
+#include "journal32.h"
+#include "dev32.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define JOURNAL_BUCKETS 4096
+
+/// the newest content of one sector changed by a logged call
+typedef struct journalSec {
+    uint64_t sec;
+    bool dirty;                 // changed since the last commit
+    struct journalSec * next;   // in its hash bucket
+    unsigned char data[];
+} journalSec;
+
+static bool _journalOn = false;
+static bool _checkpointing = false;
+static int _logFd = -1;
+static off_t _logEnd = 0;
+static uint64_t _seq = 0;
+static int _opsInGroup = 0;
+static int _numDirty = 0;
+static bool _freedInGroup = false; // a logged call of the uncommitted group freed a cluster
+static pthread_mutex_t _journalLock = PTHREAD_MUTEX_INITIALIZER;
+static journalSec * _buckets[JOURNAL_BUCKETS];
+static journalSec ** _secs = NULL;  // all held sectors, for commits and checkpoints
+static int _numSecs = 0;
+static int _volSecs = 0;
+static uint64_t _minSec = UINT64_MAX, _maxSec = 0;
+static __thread int _depth = 0;
+static journalHeader _volume; // identity of the mounted volume, copied into every record
+
+static int _journal_commit();
+
+static uint64_t _journal_checksum(const unsigned char * p, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    size_t i;
+    for(i = 0; i < n; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static journalSec * _journal_find(uint64_t sec) {
+    journalSec * s = _buckets[sec % JOURNAL_BUCKETS];
+    while(s != NULL && s->sec != sec) s = s->next;
+    return s;
+}
+
+/// the held copy of @sec, read from the device if it is not held yet
+static journalSec * _journal_get(uint64_t sec) {
+    journalSec * s = _journal_find(sec);
+    if(s != NULL) return s;
+    s = malloc(sizeof(journalSec) + _status.BytesPerSec);
+    s->sec = sec;
+    s->dirty = false;
+    size_t done = _dev_read_raw(s->data, _status.BytesPerSec, (off_t)sec * _status.BytesPerSec);
+    memset(s->data + done, 0, _status.BytesPerSec - done);
+    s->next = _buckets[sec % JOURNAL_BUCKETS];
+    _buckets[sec % JOURNAL_BUCKETS] = s;
+    if(_numSecs == _volSecs) {
+        _volSecs = _volSecs ? 2 * _volSecs : 256;
+        _secs = realloc(_secs, _volSecs * sizeof(journalSec *));
+    }
+    _secs[_numSecs++] = s;
+    if(sec < _minSec) _minSec = sec;
+    if(sec > _maxSec) _maxSec = sec;
+    return s;
+}
+
+/// true if writing @buf at @pos over the held sector @s frees a cluster in the first FAT
+static bool _journal_frees(const journalSec * s, const unsigned char * buf, size_t n, off_t pos) {
+    if(s->sec < _status.startFATSec || s->sec >= (uint64_t)_status.startFATSec + _status.FATSz) return false;
+    off_t secPos = (off_t)s->sec * _status.BytesPerSec;
+    off_t lo = pos > secPos ? pos : secPos;
+    off_t hi = pos + (off_t)n < secPos + _status.BytesPerSec ? pos + (off_t)n : secPos + _status.BytesPerSec;
+    lo += (SIZE_FAT_ENTRY - lo % SIZE_FAT_ENTRY) % SIZE_FAT_ENTRY;
+    for( ; lo + SIZE_FAT_ENTRY <= hi; lo += SIZE_FAT_ENTRY) {
+        uint32_t was, now;
+        memcpy(&was, s->data + (lo - secPos), SIZE_FAT_ENTRY);
+        memcpy(&now, buf + (lo - pos), SIZE_FAT_ENTRY);
+        if((was & 0x0FFFFFFF) != 0 && (now & 0x0FFFFFFF) == 0) return true;
+    }
+    return false;
+}
+
+/// copy between the held sector @s and the device range @pos .. @pos + @n of @buf
+static void _journal_overlap(journalSec * s, unsigned char * buf, size_t n, off_t pos, bool toSec) {
+    off_t secPos = (off_t)s->sec * _status.BytesPerSec;
+    off_t lo = pos > secPos ? pos : secPos;
+    off_t hi = pos + (off_t)n < secPos + _status.BytesPerSec ? pos + (off_t)n : secPos + _status.BytesPerSec;
+    if(lo >= hi) return;
+    if(toSec) memcpy(s->data + (lo - secPos), buf + (lo - pos), hi - lo);
+    else memcpy(buf + (lo - pos), s->data + (lo - secPos), hi - lo);
+}
+
+/// run @body on every held sector @s overlapping the range, by lookup or by scan, whichever is shorter
+#define JOURNAL_FOR_RANGE(pos, n, s, body) do { \
+    uint64_t _first = (pos) / _status.BytesPerSec, _last = ((pos) + (n) - 1) / _status.BytesPerSec; \
+    if(_first < _minSec) _first = _minSec; \
+    if(_last > _maxSec) _last = _maxSec; \
+    if(_first <= _last && _last - _first < (uint64_t)_numSecs) { \
+        uint64_t _k; \
+        for(_k = _first; _k <= _last; _k++) { journalSec * s = _journal_find(_k); if(s) { body; } } \
+    } else if(_first <= _last) { \
+        int _i; \
+        for(_i = 0; _i < _numSecs; _i++) { journalSec * s = _secs[_i]; \
+            if(s->sec >= _first && s->sec <= _last) { body; } } \
+    } \
+} while(0)
+
+void _journal_read(void * buf, size_t n, off_t pos) {
+    if(!_journalOn || n == 0) return;
+    pthread_mutex_lock(&_journalLock);
+    if(_numSecs > 0) JOURNAL_FOR_RANGE(pos, n, s, _journal_overlap(s, buf, n, pos, false));
+    pthread_mutex_unlock(&_journalLock);
+}
+
+bool _journal_write(const void * buf, size_t n, off_t pos) {
+    if(!_journalOn || _checkpointing || n == 0) return false;
+    pthread_mutex_lock(&_journalLock);
+    bool logged = _depth > 0;
+    if(logged) {
+        uint64_t k;
+        for(k = pos / _status.BytesPerSec; k <= (pos + n - 1) / _status.BytesPerSec; k++) {
+            journalSec * s = _journal_get(k);
+            if(!_freedInGroup && _journal_frees(s, buf, n, pos)) _freedInGroup = true;
+            _journal_overlap(s, (unsigned char *)buf, n, pos, true);
+            if(!s->dirty) _numDirty++;
+            s->dirty = true;
+        }
+    } else if(_numSecs > 0) {
+        // the log must have the change before the device does, or a replay would put the
+        // logged copy back over it. What the change points to (data, FAT) is flushed first
+        bool held = false;
+        JOURNAL_FOR_RANGE(pos, n, s, {
+            _journal_overlap(s, (unsigned char *)buf, n, pos, true);
+            if(!s->dirty) _numDirty++;
+            s->dirty = true;
+            held = true;
+        });
+        if(held) {
+            _dev_flush();
+            _journal_commit();
+        }
+    }
+    pthread_mutex_unlock(&_journalLock);
+    return logged;
+}
+
+/// write every held sector in place, flush the device, then empty the log
+static void _journal_checkpoint() {
+    int i;
+    _checkpointing = true;
+    for(i = 0; i < _numSecs; i++) {
+        _dev_write(_secs[i]->data, _status.BytesPerSec, (off_t)_secs[i]->sec * _status.BytesPerSec);
+        free(_secs[i]);
+    }
+    _dev_flush();
+    if(ftruncate(_logFd, 0) == 0) fsync(_logFd);
+    _checkpointing = false;
+    _logEnd = 0;
+    _numSecs = 0;
+    _numDirty = 0;
+    _minSec = UINT64_MAX;
+    _maxSec = 0;
+    memset(_buckets, 0, sizeof(_buckets));
+    STAT_ADD(journalCheckpoints, 1);
+}
+
+/// append the dirty sectors to the log as one record and flush the log once
+static int _journal_commit() {
+    _opsInGroup = 0;
+    if(_numDirty == 0) return 0;
+    size_t size = sizeof(journalHeader) + (size_t)_numDirty * (sizeof(uint64_t) + _status.BytesPerSec);
+    unsigned char * rec = malloc(size);
+    journalHeader * hdr = (journalHeader *)rec;
+    uint64_t * nums = (uint64_t *)(rec + sizeof(journalHeader));
+    unsigned char * data = (unsigned char *)(nums + _numDirty);
+    int i, k = 0;
+    for(i = 0; i < _numSecs; i++) {
+        if(!_secs[i]->dirty) continue;
+        nums[k] = _secs[i]->sec;
+        memcpy(data + (size_t)k * _status.BytesPerSec, _secs[i]->data, _status.BytesPerSec);
+        k++;
+    }
+    *hdr = _volume;
+    memcpy(hdr->magic, JOURNAL_MAGIC, 8);
+    hdr->seq = ++_seq;
+    hdr->numSecs = _numDirty;
+    hdr->bytesPerSec = _status.BytesPerSec;
+    hdr->checksum = _journal_checksum(rec + sizeof(journalHeader), size - sizeof(journalHeader));
+
+    size_t done = 0;
+    while(done < size) {
+        ssize_t r = pwrite(_logFd, rec + done, size - done, _logEnd + done);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        done += r;
+    }
+    free(rec);
+    if(done < size || fdatasync(_logFd) != 0) return 1;
+    _logEnd += size;
+    STAT_ADD(journalCommits, 1);
+    STAT_ADD(journalSecs, _numDirty);
+    for(i = 0; i < _numSecs; i++) _secs[i]->dirty = false;
+    _numDirty = 0;
+    _freedInGroup = false;
+    if(_logEnd >= JOURNAL_CKPT_BYTES) _journal_checkpoint();
+    return 0;
+}
+
+int _journal_begin() {
+    if(!_journalOn) return 0;
+    pthread_mutex_lock(&_journalLock);
+    _depth++;
+    pthread_mutex_unlock(&_journalLock);
+    return 1;
+}
+
+void _journal_end(int * scope) {
+    if(!*scope) return;
+    pthread_mutex_lock(&_journalLock);
+    if(--_depth == 0 && (++_opsInGroup >= JOURNAL_GROUP_OPS || _numDirty >= JOURNAL_GROUP_SECS))
+        _journal_commit();
+    pthread_mutex_unlock(&_journalLock);
+}
+
+void _journal_alloc() {
+    if(!_journalOn || _depth > 0) return;
+    pthread_mutex_lock(&_journalLock);
+    if(_freedInGroup) _journal_commit();
+    pthread_mutex_unlock(&_journalLock);
+}
+
+int _journal_sync() {
+    if(!_journalOn) return 0;
+    pthread_mutex_lock(&_journalLock);
+    int err = _journal_commit();
+    pthread_mutex_unlock(&_journalLock);
+    return err;
+}
+
+/// fill the volume identity of @hdr from the BPB and from the image file or device FAT_FS_PATH names
+static void _journal_identity(journalHeader * hdr) {
+    FAT32_BPB bpb;
+    struct stat sb;
+    memset(hdr, 0, sizeof(journalHeader));
+    if(_dev_read_raw(&bpb, sizeof(bpb), 0) == sizeof(bpb)) {
+        hdr->volID = bpb.VolID;
+        hdr->totSec = bpb.bpb_common.TotSec16 ? bpb.bpb_common.TotSec16 : bpb.bpb_common.TotSec32;
+    }
+    const char * image = getenv("FAT_FS_PATH");
+    if(image != NULL && stat(image, &sb) == 0) {
+        hdr->dev = S_ISBLK(sb.st_mode) ? sb.st_rdev : sb.st_dev;
+        hdr->ino = S_ISBLK(sb.st_mode) ? 0 : sb.st_ino;
+    }
+}
+
+/**
+ * replay the complete records of the log @path: every record is checked against its
+ * checksum and must follow the previous one, the first bad record ends the replay.
+ * the log is then emptied and the metadata calls of this mount are logged there, up to
+ * _OS_finalization or the exit of the program. A log whose records name another volume
+ * (serial number, size, image file or device) is left as it is and nothing is logged
+ * @return number of records replayed, -1 if the log cannot be opened or is not ours
+ */
+int _journal_open(const char * path) {
+    _logFd = open(path, O_RDWR | O_CREAT, 0644);
+    if(_logFd < 0) return -1;
+    _journal_identity(&_volume);
+    off_t off = 0;
+    int replayed = 0;
+    journalHeader hdr;
+    while(pread(_logFd, &hdr, sizeof(hdr), off) == sizeof(hdr)) {
+        if(memcmp(hdr.magic, JOURNAL_MAGIC, 8) != 0 || hdr.bytesPerSec != _status.BytesPerSec
+           || hdr.numSecs == 0 || (replayed > 0 && hdr.seq != _seq + 1)) break;
+        bool ours = hdr.volID == _volume.volID && hdr.totSec == _volume.totSec && hdr.dev == _volume.dev
+            && hdr.ino == _volume.ino;
+        if(!ours && replayed == 0) {
+            // the records of another volume must not be written here, nor thrown away
+            close(_logFd);
+            _logFd = -1;
+            return -1;
+        }
+        if(!ours) break;
+        size_t size = (size_t)hdr.numSecs * (sizeof(uint64_t) + hdr.bytesPerSec);
+        unsigned char * body = malloc(size);
+        if(body == NULL || pread(_logFd, body, size, off + sizeof(hdr)) != (ssize_t)size
+           || _journal_checksum(body, size) != hdr.checksum) {
+            free(body);
+            break;
+        }
+        uint64_t * nums = (uint64_t *)body;
+        unsigned char * data = body + (size_t)hdr.numSecs * sizeof(uint64_t);
+        uint32_t i;
+        for(i = 0; i < hdr.numSecs; i++)
+            _dev_write(data + (size_t)i * hdr.bytesPerSec, hdr.bytesPerSec, (off_t)nums[i] * hdr.bytesPerSec);
+        free(body);
+        _seq = hdr.seq;
+        off += sizeof(hdr) + size;
+        replayed++;
+    }
+    if(replayed > 0) _dev_flush();
+    if(ftruncate(_logFd, 0) == 0) fsync(_logFd);
+    _logEnd = 0;
+    _journalOn = true;
+    static bool registered = false; // programs rarely call _OS_finalization, commit at exit too
+    if(!registered) atexit(_journal_close);
+    registered = true;
+    return replayed;
+}
+
+void _journal_close() {
+    if(!_journalOn) return;
+    pthread_mutex_lock(&_journalLock);
+    _journal_commit();
+    _journal_checkpoint();
+    free(_secs);
+    _secs = NULL;
+    _volSecs = 0;
+    _journalOn = false;
+    close(_logFd);
+    _logFd = -1;
+    pthread_mutex_unlock(&_journalLock);
+}
+
+/** commit the metadata calls logged so far with one flush of the log, or flush the
+ * device when the mount has no log
+ * @return 0 if succeed, -1 if the log could not be written
+ */
+int OS_sync()
+{
+    STAT_TIMED(OS_OP_SYNC);
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    if(!_journalOn) return _dev_flush() == 0 ? 0 : -1;
+    return _journal_sync() ? -1 : 0;
+}
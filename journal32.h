@@ -0,0 +1,64 @@
+/**
+ Header file for the intent log of the metadata updates of the FAT32 API
+ */
+
+#ifndef _JOURNAL32_H
+#define _JOURNAL32_H
+
+#include "fat16_32.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/// a group is committed once this many logged calls are done
+#define JOURNAL_GROUP_OPS 32
+
+/// ... or once this many sectors are waiting to be committed
+#define JOURNAL_GROUP_SECS 2048
+
+/// the log is checkpointed once it grows past this size
+#define JOURNAL_CKPT_BYTES (4 << 20)
+
+#define JOURNAL_MAGIC "FAT32JNL"
+
+/// head of one record of the log, followed by numSecs sector numbers and their data
+typedef struct {
+    char magic[8];
+    uint64_t seq;         // records of a log are numbered without gaps
+    uint32_t numSecs;
+    uint32_t bytesPerSec;
+    uint32_t volID;       // BS_VolID, the time of the format unless mkfat32 was given one
+    uint32_t totSec;      // size of the volume in sectors
+    uint64_t dev;         // device of the image file, or the block device holding the volume
+    uint64_t ino;         // inode of the image file, 0 for a block device
+    uint64_t checksum;    // of the sector numbers and the data
+} journalHeader;
+
+/// log the device writes of the enclosing OS_* call, calls made from it join its group
+#define JOURNAL_OP() \
+    int _journal_scope __attribute__((cleanup(_journal_end))) = _journal_begin()
+
+int _journal_begin();
+
+void _journal_end(int * scope);
+
+/// replay the log at @path and log the metadata calls of this mount there, -1 if it cannot be
+/// opened or holds the records of another volume
+int _journal_open(const char * path);
+
+/// commit, checkpoint and close the log
+void _journal_close();
+
+/// commit the calls logged so far, 0 if succeed
+int _journal_sync();
+
+/// before an unlogged call takes free clusters: commit the group if it freed some
+void _journal_alloc();
+
+/// put logged sectors over the @n bytes read at @pos into @buf
+void _journal_read(void * buf, size_t n, off_t pos);
+
+/// log a device write if a logged call is running (true), otherwise patch the logged sectors it overlaps (false)
+bool _journal_write(const void * buf, size_t n, off_t pos);
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ mkfat32: create a FAT32 image, optionally filled with a host directory tree
+ Usage: mkfat32 [-s bytesPerSec] [-c secPerClus] [-f numFATs] [-r rsvdSecCnt]
+                [-l label] [-d host_dir] image size[K|M|G]
+*/
+#include "fat16_32.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void usage(const char * prog) {
+    fprintf(stderr, "Usage: %s [-s bytesPerSec] [-c secPerClus] [-f numFATs] [-r rsvdSecCnt]"
+                    " [-l label] [-d host_dir] image size[K|M|G]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    formatParam param;
+    memset(&param, 0, sizeof(param));
+    const char * host_dir = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "s:c:f:r:l:d:")) != -1) {
+        switch(opt) {
+            case 's': param.bytesPerSec = atoi(optarg); break;
+            case 'c': param.secPerClus = atoi(optarg); break;
+            case 'f': param.numFATs = atoi(optarg); break;
+            case 'r': param.rsvdSecCnt = atoi(optarg); break;
+            case 'l': param.label = optarg; break;
+            case 'd': host_dir = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if(argc - optind != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    char * end;
+    param.size = strtoull(argv[optind + 1], &end, 10);
+    switch(*end) {
+        case 'G': case 'g': param.size <<= 10; /* fall through */
+        case 'M': case 'm': param.size <<= 10; /* fall through */
+        case 'K': case 'k': param.size <<= 10; break;
+        case '\0': break;
+        default: usage(argv[0]); return 1;
+    }
+
+    int status = OS_format(argv[optind], &param);
+    if(status == -1) {
+        fprintf(stderr, "invalid geometry, or too few clusters for FAT32\n");
+        return 1;
+    } else if(status != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if(host_dir) {
+        setenv("FAT_FS_PATH", argv[optind], 1);
+        int n = OS_build_image(host_dir);
+        if(n < 0) {
+            fprintf(stderr, "cannot copy %s into the image: %d\n", host_dir, n);
+            return 1;
+        }
+        printf("%d files and dirs copied\n", n);
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Formatter for the FAT32 API
+ *
+ * OS_format(const char *path, const formatParam *param): create a FAT32 image at @path
+ *
+ * The image is created as a sparse file: only the boot sectors, the FSInfo sectors
+ * and the first entries of every FAT are written, everything else reads as zero.
+ * This makes formatting cost independent of the size of the volume.
+ */
+
+#include "fat16_32.h"
+#include "fat32api.h"
+#include "utils32.h"
+#include "stats32.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define FSINFO_LEAD_SIG 0x41615252
+#define FSINFO_STRUC_SIG 0x61417272
+#define FSINFO_TRAIL_SIG 0xAA550000
+/// fewer clusters than this make the volume FAT16 for every driver, whatever the BPB says
+#define FAT32_MIN_CLUS 65525
+
+/// true if @x is a power of two between @lo and @hi
+static bool _pow2_in(unsigned int x, unsigned int lo, unsigned int hi) {
+    return x >= lo && x <= hi && (x & (x - 1)) == 0;
+}
+
+/// default cluster size used by Microsoft's formatter for a volume of @size bytes
+static unsigned int _default_clus_bytes(uint64_t size) {
+    if(size <= 260ULL << 20) return 512;
+    if(size <= 8ULL << 30) return 4096;
+    if(size <= 16ULL << 30) return 8192;
+    if(size <= 32ULL << 30) return 16384;
+    return 32768;
+}
+
+/// write @n bytes at @pos of @fd, 0 if succeed
+static int _put(int fd, const void * buf, size_t n, off_t pos) {
+    return pwrite(fd, buf, n, pos) == (ssize_t)n ? 0 : 1;
+}
+
+/** size the FAT of a volume of @totSec sectors: it must map every cluster left after the
+ * FATs themselves, so iterate to the fixed point
+ * @return 0 with @fatSz and @clus set, 1 if the metadata alone does not fit
+ */
+static int _layout(uint32_t totSec, unsigned int bps, unsigned int spc, unsigned int numFATs,
+                   unsigned int rsvd, uint32_t * fatSz, uint32_t * clus) {
+    *fatSz = 1;
+    *clus = 0;
+    int iter;
+    for(iter = 0; iter < 16; iter++) {
+        uint64_t meta = rsvd + (uint64_t)numFATs * *fatSz;
+        if(meta + spc > totSec) return 1;
+        *clus = (totSec - meta) / spc;
+        uint32_t need = ((uint64_t)(*clus + 2) * SIZE_FAT_ENTRY + bps - 1) / bps;
+        if(need <= *fatSz) break;
+        *fatSz = need;
+    }
+    return 0;
+}
+
+/** create a FAT32 image of @param->size bytes at @path, replacing any existing file
+ * fields of @param left 0 take their defaults: 512 bytes per sector, the cluster size
+ * Microsoft's formatter picks for this size (halved while it leaves too few clusters),
+ * 2 FATs and 32 reserved sectors
+ * @return 0 if succeed, -1 if the geometry is invalid or leaves fewer than 65525 clusters,
+ * -2 if the image cannot be written
+ */
+int OS_format(const char *path, const formatParam *param)
+{
+    STAT_TIMED(OS_OP_FORMAT);
+    unsigned int bps = param->bytesPerSec ? param->bytesPerSec : 512;
+    unsigned int spc = param->secPerClus ? param->secPerClus : _default_clus_bytes(param->size) / bps;
+    if(spc == 0) spc = 1;
+    unsigned int numFATs = param->numFATs ? param->numFATs : 2;
+    unsigned int rsvd = param->rsvdSecCnt ? param->rsvdSecCnt : 32;
+    if(!_pow2_in(bps, 512, 4096) || !_pow2_in(spc, 1, 128) || bps * spc > 65536
+       || numFATs < 1 || numFATs > 4 || rsvd < 8 || rsvd > 0xFFFF)
+        return -1;
+    uint64_t totSec64 = param->size / bps;
+    if(totSec64 > 0xFFFFFFFFULL) return -1;
+    uint32_t totSec = totSec64;
+
+    uint32_t fatSz, clus;
+    // a default cluster size is halved until the volume has enough clusters to be FAT32
+    while(_layout(totSec, bps, spc, numFATs, rsvd, &fatSz, &clus) == 0 && clus < FAT32_MIN_CLUS
+          && param->secPerClus == 0 && spc > 1)
+        spc /= 2;
+    if(_layout(totSec, bps, spc, numFATs, rsvd, &fatSz, &clus) != 0 || clus < FAT32_MIN_CLUS
+       || clus > 0x0FFFFFF5)
+        return -1;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return -2;
+    int err = ftruncate(fd, (off_t)totSec * bps) != 0;
+
+    unsigned char * sec = calloc(bps, 1);
+    FAT32_BPB * bpb = (FAT32_BPB *)sec;
+    memcpy(bpb->bpb_common.jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(bpb->bpb_common.OEMName, "MSWIN4.1", 8);
+    bpb->bpb_common.BytsPerSec = bps;
+    bpb->bpb_common.SecPerClus = spc;
+    bpb->bpb_common.RsvdSecCnt = rsvd;
+    bpb->bpb_common.NumFATs = numFATs;
+    bpb->bpb_common.Media = 0xF8;
+    bpb->bpb_common.SecPerTrk = 63;
+    bpb->bpb_common.NumHeads = 255;
+    bpb->bpb_common.TotSec32 = totSec;
+    bpb->FATSz32 = fatSz;
+    bpb->RootClus = 2;
+    bpb->FSInfo = 1;
+    bpb->BkBootSec = 6;
+    bpb->DrvNum = 0x80;
+    bpb->BootSig = 0x29;
+    bpb->VolID = param->volID ? param->volID : (unsigned int)time(NULL);
+    memset(bpb->VolLab, 0x20, 11);
+    memcpy(bpb->VolLab, param->label ? param->label : "NO NAME", strnlen(param->label ? param->label : "NO NAME", 11));
+    memcpy(bpb->FilSysType, "FAT32   ", 8);
+    sec[510] = 0x55;
+    sec[511] = 0xAA;
+    err |= _put(fd, sec, bps, 0);
+    err |= _put(fd, sec, bps, (off_t)6 * bps);
+
+    // FSInfo: every cluster but the root one is free, the next one to hand out is 3
+    memset(sec, 0, bps);
+    uint32_t * info = (uint32_t *)sec;
+    info[0] = FSINFO_LEAD_SIG;
+    info[484 / 4] = FSINFO_STRUC_SIG;
+    info[488 / 4] = clus - 1;
+    info[492 / 4] = 3;
+    info[508 / 4] = FSINFO_TRAIL_SIG;
+    err |= _put(fd, sec, bps, (off_t)1 * bps);
+    err |= _put(fd, sec, bps, (off_t)7 * bps);
+
+    // FAT[0] holds the media byte, FAT[1] the EOC mark, FAT[2] ends the root dir chain
+    uint32_t head[3] = {0x0FFFFF00 | 0xF8, 0x0FFFFFFF, 0x0FFFFFFF};
+    unsigned int i;
+    for(i = 0; i < numFATs; i++)
+        err |= _put(fd, head, sizeof(head), (off_t)(rsvd + i * fatSz) * bps);
+    free(sec);
+    err |= close(fd) != 0;
+    return err ? -2 : 0;
+}
@@ -64,6 +64,10 @@ extern int OS_creat(const char *path);
 
 extern int OS_write(int fildes, const void *buf, int nbytes, int offset);
 
+extern ssize_t OS_export(const char *path, int host_fd);
+
+extern ssize_t OS_import(const char *host_path, const char *path);
+
 
 char *cwdPath;          // current working dir name
 int fdCount; 
@@ -0,0 +1,151 @@
+/*
+ * Operation counters and latency histograms for the FAT32 API
+ *
+ * OS_stats(osStats *out, bool reset): copy (and optionally clear) all counters
+ * OS_stats_prometheus(int fd): write all counters to @fd in Prometheus text format
+ *
+ * All counters are updated with relaxed atomic adds, so they are always on and can
+ * be read while other threads run. Latencies go into log2 buckets of nanoseconds.
+ */
+
+#include "fat16_32.h"
+#include "fat32api.h"
+#include "stats32.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+osStats _stats;
+
+__thread int _stat_curOp = -1;
+
+static const char * _op_names[OS_OP_COUNT] = {
+    "cd", "open", "close", "read", "readDir", "mkdir", "rmdir", "rm", "creat", "write",
+    "export", "import", "extract_tree", "build_image", "format", "walk", "defrag", "fsync", "append",
+    "sync", "compactdir", "rename", "rmtree"
+};
+
+uint64_t _stat_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+statTimer _stat_timer_begin(int op) {
+    statTimer t = {-1, 0};
+    if(_stat_curOp >= 0) return t; // nested call, the outer one is timed
+    _stat_curOp = op;
+    t.op = op;
+    t.start = _stat_now();
+    return t;
+}
+
+void _stat_timer_end(statTimer * t) {
+    if(t->op < 0) return;
+    uint64_t ns = _stat_now() - t->start;
+    int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    if(bucket >= OS_STAT_BUCKETS) bucket = OS_STAT_BUCKETS - 1;
+    STAT_ADD(latBuckets[t->op][bucket], 1);
+    STAT_ADD(latCount[t->op], 1);
+    STAT_ADD(latSumNs[t->op], ns);
+    _stat_curOp = -1;
+}
+
+void _stat_count_fat_change(uint32_t oldValue, uint32_t newValue) {
+    if(oldValue == 0 && newValue != 0) STAT_ADD(clusAllocated, 1);
+    else if(oldValue != 0 && newValue == 0) STAT_ADD(clusFreed, 1);
+}
+
+void _stat_count_dev(bool isWrite, size_t n, off_t pos) {
+    bool isFAT = pos >= (off_t)_status.startFATSec * _status.BytesPerSec
+        && pos < (off_t)_status.startDataSec * _status.BytesPerSec;
+    if(isWrite) {
+        STAT_ADD(devWrites, 1);
+        STAT_ADD(bytesWritten, n);
+        if(isFAT) STAT_ADD(fatWrites, 1);
+    } else {
+        STAT_ADD(devReads, 1);
+        STAT_ADD(bytesRead, n);
+        if(isFAT) STAT_ADD(fatReads, 1);
+    }
+}
+
+/** copy all counters to @out, and clear them if @reset
+ * every counter is read (and cleared) atomically on its own, the copy as a whole is
+ * not a snapshot of one instant
+ */
+void OS_stats(osStats *out, bool reset)
+{
+    uint64_t * src = (uint64_t *)&_stats;
+    uint64_t * dst = (uint64_t *)out;
+    size_t i;
+    for(i = 0; i < sizeof(osStats) / sizeof(uint64_t); i++) {
+        if(reset) dst[i] = __atomic_exchange_n(&src[i], 0, __ATOMIC_RELAXED);
+        else dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/** write all counters to @fd in Prometheus text exposition format
+ * @return 0 if succeed, -1 if writing failed
+ */
+int OS_stats_prometheus(int fd)
+{
+    osStats st;
+    OS_stats(&st, false);
+    int err = 0;
+    err |= dprintf(fd, "# HELP fat32_device_ops_total Device read and write syscalls.\n"
+                       "# TYPE fat32_device_ops_total counter\n"
+                       "fat32_device_ops_total{dir=\"read\"} %llu\n"
+                       "fat32_device_ops_total{dir=\"write\"} %llu\n",
+                   (unsigned long long)st.devReads, (unsigned long long)st.devWrites) < 0;
+    err |= dprintf(fd, "# HELP fat32_device_bytes_total Bytes moved to and from the device.\n"
+                       "# TYPE fat32_device_bytes_total counter\n"
+                       "fat32_device_bytes_total{dir=\"read\"} %llu\n"
+                       "fat32_device_bytes_total{dir=\"write\"} %llu\n",
+                   (unsigned long long)st.bytesRead, (unsigned long long)st.bytesWritten) < 0;
+    err |= dprintf(fd, "# HELP fat32_fat_ops_total Device accesses to the FAT region.\n"
+                       "# TYPE fat32_fat_ops_total counter\n"
+                       "fat32_fat_ops_total{dir=\"read\"} %llu\n"
+                       "fat32_fat_ops_total{dir=\"write\"} %llu\n",
+                   (unsigned long long)st.fatReads, (unsigned long long)st.fatWrites) < 0;
+    err |= dprintf(fd, "# HELP fat32_dir_clusters_scanned_total Directory clusters read while scanning.\n"
+                       "# TYPE fat32_dir_clusters_scanned_total counter\n"
+                       "fat32_dir_clusters_scanned_total %llu\n",
+                   (unsigned long long)st.dirClusScanned) < 0;
+    err |= dprintf(fd, "# HELP fat32_clusters_total Clusters allocated and released.\n"
+                       "# TYPE fat32_clusters_total counter\n"
+                       "fat32_clusters_total{event=\"alloc\"} %llu\n"
+                       "fat32_clusters_total{event=\"free\"} %llu\n",
+                   (unsigned long long)st.clusAllocated, (unsigned long long)st.clusFreed) < 0;
+    err |= dprintf(fd, "# HELP fat32_cache_lookups_total Metadata cache lookups.\n"
+                       "# TYPE fat32_cache_lookups_total counter\n"
+                       "fat32_cache_lookups_total{result=\"hit\"} %llu\n"
+                       "fat32_cache_lookups_total{result=\"miss\"} %llu\n",
+                   (unsigned long long)st.cacheHits, (unsigned long long)st.cacheMisses) < 0;
+    err |= dprintf(fd, "# HELP fat32_journal_total Intent log activity.\n"
+                       "# TYPE fat32_journal_total counter\n"
+                       "fat32_journal_total{event=\"commit\"} %llu\n"
+                       "fat32_journal_total{event=\"sector\"} %llu\n"
+                       "fat32_journal_total{event=\"checkpoint\"} %llu\n",
+                   (unsigned long long)st.journalCommits, (unsigned long long)st.journalSecs,
+                   (unsigned long long)st.journalCheckpoints) < 0;
+    err |= dprintf(fd, "# HELP fat32_op_latency_seconds Latency of OS_* calls.\n"
+                       "# TYPE fat32_op_latency_seconds histogram\n") < 0;
+    int op, b;
+    for(op = 0; op < OS_OP_COUNT; op++) {
+        uint64_t cum = 0;
+        for(b = 0; b < OS_STAT_BUCKETS - 1; b++) {
+            cum += st.latBuckets[op][b];
+            // bucket b holds latencies in [2^b, 2^(b+1)) ns
+            err |= dprintf(fd, "fat32_op_latency_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                           _op_names[op], (double)(1ULL << (b + 1)) / 1e9, (unsigned long long)cum) < 0;
+        }
+        err |= dprintf(fd, "fat32_op_latency_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n"
+                           "fat32_op_latency_seconds_sum{op=\"%s\"} %.9f\n"
+                           "fat32_op_latency_seconds_count{op=\"%s\"} %llu\n",
+                       _op_names[op], (unsigned long long)st.latCount[op],
+                       _op_names[op], st.latSumNs[op] / 1e9,
+                       _op_names[op], (unsigned long long)st.latCount[op]) < 0;
+    }
+    return err ? -1 : 0;
+}
@@ -0,0 +1,42 @@
+/**
+ Header file for the operation counters and latency histograms of the FAT32 API
+ */
+
+#ifndef _STATS32_H
+#define _STATS32_H
+
+#include "fat16_32.h"
+#include <stdint.h>
+#include <sys/types.h>
+
+/// state of one timed call, closed by _stat_timer_end when it goes out of scope
+typedef struct {
+    int op;          // OS_OP_* of the call, -1 if an outer call is already timed
+    uint64_t start;  // start time in ns
+} statTimer;
+
+extern osStats _stats;
+
+/// outermost OS_* operation running on this thread, -1 if none
+extern __thread int _stat_curOp;
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&_stats.field, (n), __ATOMIC_RELAXED)
+
+/// time the enclosing OS_* call until it returns, calls made from it are not timed again
+#define STAT_TIMED(op) \
+    statTimer _stat_timer __attribute__((cleanup(_stat_timer_end))) = _stat_timer_begin(op)
+
+/// monotonic clock in ns
+uint64_t _stat_now();
+
+statTimer _stat_timer_begin(int op);
+
+void _stat_timer_end(statTimer * t);
+
+/// count a FAT entry going from @oldValue to @newValue as an allocation or a release
+void _stat_count_fat_change(uint32_t oldValue, uint32_t newValue);
+
+/// count one device access of @n bytes at @pos
+void _stat_count_dev(bool isWrite, size_t n, off_t pos);
+
+#endif
@@ -91,16 +91,17 @@ int main(int argc, char *argv[]) {
     }
     else if(strcmp(args[0], "cp") == 0){
         printf("copying file %s of size %d to %s \n", args[1], atoi(args[3]), args[2]);
-        //unsigned char *readFile(char *name, int numbytes, int offset);
-        char *readbuf = copyFile(args[1], atoi(args[3]), 0);
-        //unsigned char *readbuf = "";
-        FILE *write_ptr;
-        write_ptr = fopen(args[2],"wb"); 
-        fwrite(readbuf,atoi(args[3]),1,write_ptr);
-        fclose(write_ptr);
+        int host_fd = open(args[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(host_fd < 0)
+        {
+            perror("Error");
+            continue;
+        }
+        ssize_t copied = OS_export(args[1], host_fd);
+        printf("Exported %zd bytes from %s\n", copied, args[1]);
+        close(host_fd);
         // printf("After CD: %s\n", cwdPath);
         fflush(stdout);
-        free(readbuf);
     } 
     else if(strcmp(args[0], "cpout") == 0){
         printf("copying file %s of size %d to %s \n", args[1], atoi(args[3]), args[2]);
@@ -124,11 +125,21 @@ int main(int argc, char *argv[]) {
         }*/
         int fd = OS_open(args[2]);
         OS_write(fd, buf, atoi(args[3]), 0);
+        OS_close(fd);
     
         // printf("After CD: %s\n", cwdPath);
         fflush(stdout);
         free(buf);
     }
+    else if(strcmp(args[0], "import") == 0){
+        printf("importing file %s to %s\n", args[1], args[2]);
+        ssize_t status = OS_import(args[1], args[2]);
+        if(status >= 0) printf("Imported %zd bytes\n", status);
+        else if(status == -2) printf("The file path already exist\n");
+        else if(status == -3) printf("Free space too small or too fragmented\n");
+        else printf("Invalid path\n");
+        fflush(stdout);
+    }
     else if(strcmp(args[0], "read") == 0){
         if(argCount >= 4) {
         //printf("path depth is %d\n", pathdepth);
@@ -0,0 +1,136 @@
+/*
+ * Device I/O tracing for the FAT32 API
+ *
+ * OS_trace_start(size_t numEvents): start recording device accesses in memory
+ * OS_trace_stop(): stop recording, the recorded events are kept
+ * OS_trace_dump(const char *path): write the recorded events to a file
+ *
+ * Events go to a ring of 2^k slots. A writer claims a slot with one atomic add and
+ * publishes it by storing its sequence number last, so writers never wait on each
+ * other and the oldest events are overwritten when the ring is full.
+ */
+
+#include "fat16_32.h"
+#include "fat32api.h"
+#include "stats32.h"
+#include "trace32.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+typedef struct {
+    uint64_t seq; // claim number + 1 once the event is complete, 0 while empty
+    traceEvent ev;
+} traceSlot;
+
+static traceSlot * _ring = NULL;
+static uint64_t _ringMask = 0;
+static uint64_t _ringHead = 0; // number of slots claimed so far
+static bool _traceOn = false;
+static unsigned int _traceWriters = 0; // writers that may be using _ring
+
+void _trace_dev(bool isWrite, size_t n, off_t pos) {
+    off_t fatStart = (off_t)_status.startFATSec * _status.BytesPerSec;
+    off_t dataStart = (off_t)_status.startDataSec * _status.BytesPerSec;
+    uint32_t cluster = 0;
+    uint16_t region = TRACE_REGION_RESERVED;
+    if(pos >= dataStart) {
+        region = TRACE_REGION_DATA;
+        cluster = (pos - dataStart) / _status.BytesPerCluster + 2;
+    } else if(pos >= fatStart) {
+        // the FAT entry, whichever copy of the FAT is accessed
+        region = TRACE_REGION_FAT;
+        cluster = (pos - fatStart) % ((off_t)_status.FATSz * _status.BytesPerSec) / SIZE_FAT_ENTRY;
+    }
+    if(isWrite) TRACE_PROBE5(dev_write, pos, n, cluster, _stat_curOp, region);
+    else TRACE_PROBE5(dev_read, pos, n, cluster, _stat_curOp, region);
+
+    // the common case of tracing off costs one plain load, no shared cache line is written
+    if(!__atomic_load_n(&_traceOn, __ATOMIC_RELAXED)) return;
+    // announce ourselves before looking at _traceOn again, so OS_trace_start cannot free the ring under us
+    __atomic_fetch_add(&_traceWriters, 1, __ATOMIC_SEQ_CST);
+    if(!__atomic_load_n(&_traceOn, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_sub(&_traceWriters, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    uint64_t claim = __atomic_fetch_add(&_ringHead, 1, __ATOMIC_RELAXED);
+    traceSlot * slot = &_ring[claim & _ringMask];
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    // a reader must not see the new event under the sequence number of the old one
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->ev.timeNs = _stat_now();
+    slot->ev.offset = pos;
+    slot->ev.length = n;
+    slot->ev.cluster = cluster;
+    slot->ev.op = _stat_curOp;
+    slot->ev.flags = region | (isWrite ? TRACE_FLAG_WRITE : 0);
+    slot->ev.tid = syscall(SYS_gettid);
+    __atomic_store_n(&slot->seq, claim + 1, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&_traceWriters, 1, __ATOMIC_RELEASE);
+}
+
+/** start recording device accesses into a ring of at least @numEvents events
+ * events recorded before are dropped. The old ring is freed once the writers still
+ * recording into it are done.
+ * @return 0 if succeed, -1 if the ring cannot be allocated
+ */
+int OS_trace_start(size_t numEvents)
+{
+    uint64_t size = 1;
+    while(size < numEvents) size <<= 1;
+    __atomic_store_n(&_traceOn, false, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&_traceWriters, __ATOMIC_SEQ_CST) != 0) sched_yield();
+    free(_ring);
+    _ring = calloc(size, sizeof(traceSlot));
+    if(_ring == NULL) return -1;
+    _ringMask = size - 1;
+    _ringHead = 0;
+    __atomic_store_n(&_traceOn, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/// stop recording, the events recorded so far stay available to OS_trace_dump
+void OS_trace_stop()
+{
+    __atomic_store_n(&_traceOn, false, __ATOMIC_RELEASE);
+}
+
+/** write the recorded events, oldest first, to the file @path
+ * the file is a traceFileHeader followed by traceFileHeader.numEvents traceEvents.
+ * slots being written at the time of the dump are skipped
+ * @return number of events written, -1 if there is no trace or the file cannot be written
+ */
+long OS_trace_dump(const char *path)
+{
+    if(_ring == NULL) return -1;
+    FILE * out = fopen(path, "wb");
+    if(out == NULL) return -1;
+    uint64_t head = __atomic_load_n(&_ringHead, __ATOMIC_ACQUIRE);
+    uint64_t first = head > _ringMask + 1 ? head - (_ringMask + 1) : 0;
+    traceFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, 8);
+    hdr.version = TRACE_VERSION;
+    hdr.eventSize = sizeof(traceEvent);
+    hdr.bytesPerSec = _status.BytesPerSec;
+    hdr.bytesPerCluster = _status.BytesPerCluster;
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    uint64_t claim;
+    for(claim = first; claim < head; claim++) {
+        traceSlot * slot = &_ring[claim & _ringMask];
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != claim + 1) continue;
+        traceEvent ev = slot->ev;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // the slot may have been claimed again while we copied it
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != claim + 1) continue;
+        fwrite(&ev, sizeof(ev), 1, out);
+        hdr.numEvents++;
+    }
+    fseek(out, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    int err = fclose(out);
+    return err ? -1 : (long)hdr.numEvents;
+}
@@ -0,0 +1,33 @@
+/**
+ Header file for device I/O tracing of the FAT32 API
+
+ Every device access fires the USDT probe fat32:dev_read or fat32:dev_write with
+ (offset, length, cluster, op, region), e.g.
+   bpftrace -e 'usdt:./libFAT32.so:fat32:dev_read { @[arg3] = hist(arg1); }'
+ The probes compile to nothing when <sys/sdt.h> is not available.
+ */
+
+#ifndef _TRACE32_H
+#define _TRACE32_H
+
+#include "fat16_32.h"
+#include <stdint.h>
+#include <sys/types.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef TRACE_HAVE_USDT
+#define TRACE_PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5(fat32, name, a1, a2, a3, a4, a5)
+#else
+#define TRACE_PROBE5(name, a1, a2, a3, a4, a5) do {} while(0)
+#endif
+
+/// fire the probe and record the event of one device access of @n bytes at @pos
+void _trace_dev(bool isWrite, size_t n, off_t pos);
+
+#endif
@@ -0,0 +1,362 @@
+/*
+ * Whole-tree operations for the FAT32 API
+ *
+ * The following code works on a directory and everything below it at once:
+ *
+ * OS_extract_tree(const char *src_dir, const char *host_dir, int threads, extractStat *stat):
+ *   copy the tree under @src_dir to the host directory @host_dir
+ * OS_walk(const char *root, walkCallback cb, void *arg, int threads): call @cb for every
+ *   entry below @root
+ */
+
+#include "fat16_32.h"
+#include "fat32api.h"
+#include "utils32.h"
+#include "stats32.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/// one file to be copied out of the image
+typedef struct {
+    char * hostPath;
+    uint32_t fstClus;
+    uint32_t size;
+} extractJob;
+
+/// the list of files shared by all workers of OS_extract_tree
+typedef struct {
+    extractJob * jobs;
+    int numJobs;
+    int volJobs;
+    int next; // next job to hand out, taken atomically
+    unsigned long long bytes; // bytes copied so far, updated atomically
+    int failed; // number of files that could not be copied, updated atomically
+} extractQueue;
+
+static int _cmp_job(const void * a, const void * b) {
+    uint32_t ca = ((const extractJob *)a)->fstClus, cb = ((const extractJob *)b)->fstClus;
+    return ca < cb ? -1 : ca > cb;
+}
+
+/**
+ * create @hostDir and queue every file below the dir at cluster @dirClus
+ * sub directories are created right away, so workers only ever write files
+ * @return 0 if succeed, 1 if a host dir cannot be created
+ */
+static int _collect_tree(uint32_t dirClus, const char * hostDir, extractQueue * q) {
+    if(mkdir(hostDir, 0755) != 0 && errno != EEXIST) return 1;
+    int n = 0;
+    dirEnt * list = _read_dir_clus(dirClus, &n);
+    int err = 0;
+    int i;
+    for(i = 0; i < n && !err; i++) {
+        char name[13];
+        _FAT2flnm(list[i].dir_name, name);
+        size_t len = strlen(hostDir) + strlen(name) + 2;
+        char * hostPath = malloc(len);
+        snprintf(hostPath, len, "%s/%s", hostDir, name);
+        uint32_t fstClus = list[i].dir_fstClusLO + ((uint32_t)list[i].dir_fstClusHI << 16);
+        if(list[i].dir_attr & 0x10) {
+            err = _collect_tree(fstClus, hostPath, q);
+            free(hostPath);
+        } else {
+            if(q->numJobs == q->volJobs) {
+                q->volJobs = q->volJobs ? 2 * q->volJobs : 64;
+                q->jobs = realloc(q->jobs, q->volJobs * sizeof(extractJob));
+            }
+            q->jobs[q->numJobs].hostPath = hostPath;
+            q->jobs[q->numJobs].fstClus = fstClus;
+            q->jobs[q->numJobs].size = list[i].dir_fileSize;
+            q->numJobs++;
+        }
+    }
+    free(list);
+    return err;
+}
+
+static void * _extract_worker(void * arg) {
+    extractQueue * q = arg;
+    int idx;
+    while((idx = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->numJobs) {
+        extractJob * job = &q->jobs[idx];
+        int host_fd = open(job->hostPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(host_fd < 0) {
+            __atomic_fetch_add(&q->failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        uint32_t numClus = (job->size + _status.BytesPerCluster - 1) / _status.BytesPerCluster;
+        uint32_t remaining = job->size;
+        if(numClus > 0) {
+            int numExt = 0;
+            extent * ext = _get_extents(job->fstClus, numClus, &numExt);
+            int e;
+            for(e = 0; e < numExt && remaining > 0; e++) {
+                size_t len = (size_t)ext[e].count * _status.BytesPerCluster;
+                if(len > remaining) len = remaining;
+                size_t copied = _copy_dev_to_fd(host_fd, _clusterPos(ext[e].start), len);
+                remaining -= copied;
+                if(copied < len) break;
+            }
+            free(ext);
+        }
+        close(host_fd);
+        __atomic_fetch_add(&q->bytes, job->size - remaining, __ATOMIC_RELAXED);
+        if(remaining > 0) __atomic_fetch_add(&q->failed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/** copy the dir @src_dir and everything below it to the host directory @host_dir
+ * the tree is walked once, then the files are copied by @threads workers in order of
+ * their first cluster so the device is read mostly front to back.
+ * if @stat is not NULL, it receives the number of files, bytes and the throughput
+ * @return number of files extracted, -1 if @src_dir is invalid, -2 if it is not a directory,
+ * -3 if some host files or dirs could not be written or open files could not be flushed
+ */
+int OS_extract_tree(const char *src_dir, const char *host_dir, int threads, extractStat *stat)
+{
+    STAT_TIMED(OS_OP_EXTRACT_TREE);
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    // the workers read the device, the data open files still hold in memory goes there first
+    if(_flush_open()) return -3;
+    dirEnt * p = _OS_getEnt(src_dir);
+    if(p == NULL) return -1;
+    if(!(p->dir_attr & 0x10)) {
+        free(p);
+        return -2;
+    }
+    uint32_t dirClus = p->dir_fstClusLO + ((uint32_t)p->dir_fstClusHI << 16);
+    if(dirClus == 0) dirClus = _status.idxRootDirClus;
+    free(p);
+
+    extractQueue q;
+    memset(&q, 0, sizeof(q));
+    int excode = _collect_tree(dirClus, host_dir, &q) ? -3 : 0;
+    qsort(q.jobs, q.numJobs, sizeof(extractJob), _cmp_job);
+
+    if(threads < 1) threads = 1;
+    if(threads > q.numJobs) threads = q.numJobs > 0 ? q.numJobs : 1;
+    pthread_t * workers = malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    for( ; started < threads - 1; started++)
+        if(pthread_create(&workers[started], NULL, _extract_worker, &q) != 0) break;
+    _extract_worker(&q); // the calling thread works too
+    int i;
+    for(i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    free(workers);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if(stat) {
+        stat->files = q.numJobs - q.failed;
+        stat->bytes = q.bytes;
+        stat->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        stat->bytesPerSec = stat->seconds > 0 ? q.bytes / stat->seconds : 0;
+    }
+    for(i = 0; i < q.numJobs; i++) free(q.jobs[i].hostPath);
+    free(q.jobs);
+    if(excode == 0 && q.failed > 0) excode = -3;
+    return excode == 0 ? q.numJobs : excode;
+}
+
+/// a directory waiting to be listed by OS_walk
+typedef struct {
+    uint32_t clus;
+    char * path;
+    int depth;
+} walkTask;
+
+/// double ended queue of one walker, the owner works at the bottom, thieves at the top
+typedef struct {
+    pthread_mutex_t lock;
+    walkTask * tasks;
+    int top;
+    int bottom;
+    int vol;
+} walkDeque;
+
+typedef struct {
+    walkCallback cb;
+    void * arg;
+    walkDeque * deques;
+    int numWorkers;
+    int pending;          // tasks queued or being listed, updated atomically
+    bool stop;            // set once a callback asks to stop
+    unsigned long visited;
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleCond; // idle walkers wait here for work or the end of the walk
+    unsigned long workSeq;   // bumped under idleLock whenever a task is queued or the walk ends
+    int idle;
+} walkState;
+
+typedef struct {
+    walkState * st;
+    int self;
+} walkWorker;
+
+static void _deque_push(walkDeque * dq, walkTask task) {
+    pthread_mutex_lock(&dq->lock);
+    if(dq->bottom == dq->vol) {
+        // slide the live part down before growing
+        memmove(dq->tasks, dq->tasks + dq->top, (dq->bottom - dq->top) * sizeof(walkTask));
+        dq->bottom -= dq->top;
+        dq->top = 0;
+        if(dq->bottom == dq->vol) {
+            dq->vol = dq->vol ? 2 * dq->vol : 16;
+            dq->tasks = realloc(dq->tasks, dq->vol * sizeof(walkTask));
+        }
+    }
+    dq->tasks[dq->bottom++] = task;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+/// take a task from the bottom (own deque) or the top (stealing), 0 if there is one
+static int _deque_take(walkDeque * dq, bool steal, walkTask * task) {
+    int found = 1;
+    pthread_mutex_lock(&dq->lock);
+    if(dq->top < dq->bottom) {
+        *task = steal ? dq->tasks[dq->top++] : dq->tasks[--dq->bottom];
+        found = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+/// tell idle walkers that a task was queued, or with @all that the walk is over
+static void _walk_wake(walkState * st, bool all) {
+    pthread_mutex_lock(&st->idleLock);
+    __atomic_store_n(&st->workSeq, st->workSeq + 1, __ATOMIC_RELEASE);
+    if(all) pthread_cond_broadcast(&st->idleCond);
+    else if(st->idle > 0) pthread_cond_signal(&st->idleCond);
+    pthread_mutex_unlock(&st->idleLock);
+}
+
+/// list the dir of @task, report every entry and queue the sub dirs on deque @self
+static void _walk_dir(walkState * st, int self, walkTask * task) {
+    int n = 0;
+    dirEnt * list = _read_dir_clus(task->clus, &n);
+    int i;
+    for(i = 0; i < n && !__atomic_load_n(&st->stop, __ATOMIC_RELAXED); i++) {
+        char name[13];
+        _FAT2flnm(list[i].dir_name, name);
+        size_t len = strlen(task->path) + strlen(name) + 2;
+        char * path = malloc(len);
+        snprintf(path, len, "%s/%s", task->path, name);
+        walkEnt we = {path, task->path, &list[i], task->clus, task->depth + 1};
+        int action = st->cb(&we, st->arg);
+        __atomic_fetch_add(&st->visited, 1, __ATOMIC_RELAXED);
+        uint32_t clus = list[i].dir_fstClusLO + ((uint32_t)list[i].dir_fstClusHI << 16);
+        if(action == WALK_STOP) {
+            __atomic_store_n(&st->stop, true, __ATOMIC_RELAXED);
+        } else if(action == WALK_CONTINUE && (list[i].dir_attr & 0x10) && clus != 0) {
+            walkTask sub = {clus, path, task->depth + 1};
+            __atomic_fetch_add(&st->pending, 1, __ATOMIC_RELAXED);
+            _deque_push(&st->deques[self], sub);
+            _walk_wake(st, false);
+            continue; // the task owns the path now
+        }
+        free(path);
+    }
+    free(list);
+}
+
+static void * _walk_worker(void * arg) {
+    walkWorker * w = arg;
+    walkState * st = w->st;
+    while(__atomic_load_n(&st->pending, __ATOMIC_ACQUIRE) > 0) {
+        walkTask task;
+        unsigned long seen = __atomic_load_n(&st->workSeq, __ATOMIC_ACQUIRE);
+        int found = _deque_take(&st->deques[w->self], false, &task);
+        int k;
+        for(k = 1; found && k < st->numWorkers; k++)
+            found = _deque_take(&st->deques[(w->self + k) % st->numWorkers], true, &task);
+        if(found) {
+            // somebody is still listing a dir that may produce work: sleep until it does
+            pthread_mutex_lock(&st->idleLock);
+            st->idle++;
+            while(st->workSeq == seen && __atomic_load_n(&st->pending, __ATOMIC_ACQUIRE) > 0)
+                pthread_cond_wait(&st->idleCond, &st->idleLock);
+            st->idle--;
+            pthread_mutex_unlock(&st->idleLock);
+            continue;
+        }
+        if(!__atomic_load_n(&st->stop, __ATOMIC_RELAXED)) _walk_dir(st, w->self, &task);
+        free(task.path);
+        if(__atomic_sub_fetch(&st->pending, 1, __ATOMIC_ACQ_REL) == 0) _walk_wake(st, true);
+    }
+    return NULL;
+}
+
+/** call @cb(entry, @arg) for every file and dir below the dir @root
+ * the tree is traversed by directory cluster with @threads workers: each worker lists
+ * dirs from its own queue and steals from the others when it runs dry, so @cb is
+ * called concurrently and in no particular order. The return value of @cb decides:
+ * WALK_CONTINUE descends into a dir, WALK_PRUNE skips it, WALK_STOP ends the walk.
+ * @return number of entries reported, -1 if @root is invalid, -2 if it is not a directory
+ */
+long OS_walk(const char *root, walkCallback cb, void *arg, int threads)
+{
+    STAT_TIMED(OS_OP_WALK);
+    if(!_status.initialized) _OS_initialization();
+    if(!_status.initialized) return -1;
+    dirEnt * p = _OS_getEnt(root);
+    if(p == NULL) return -1;
+    if(!(p->dir_attr & 0x10)) {
+        free(p);
+        return -2;
+    }
+    uint32_t rootClus = p->dir_fstClusLO + ((uint32_t)p->dir_fstClusHI << 16);
+    if(rootClus == 0) rootClus = _status.idxRootDirClus;
+    free(p);
+
+    if(threads < 1) threads = 1;
+    walkState st;
+    memset(&st, 0, sizeof(st));
+    st.cb = cb;
+    st.arg = arg;
+    st.numWorkers = threads;
+    st.deques = calloc(threads, sizeof(walkDeque));
+    pthread_mutex_init(&st.idleLock, NULL);
+    pthread_cond_init(&st.idleCond, NULL);
+    walkWorker * workers = malloc(threads * sizeof(walkWorker));
+    pthread_t * tids = malloc(threads * sizeof(pthread_t));
+    int i;
+    for(i = 0; i < threads; i++) {
+        pthread_mutex_init(&st.deques[i].lock, NULL);
+        workers[i].st = &st;
+        workers[i].self = i;
+    }
+    // paths are reported without a trailing '/', so the root of the volume is ""
+    size_t len = strlen(root);
+    while(len > 0 && root[len - 1] == '/') len--;
+    walkTask first = {rootClus, strndup(root, len), 0};
+    st.pending = 1;
+    _deque_push(&st.deques[0], first);
+
+    int started = 1;
+    for( ; started < threads; started++)
+        if(pthread_create(&tids[started], NULL, _walk_worker, &workers[started]) != 0) break;
+    _walk_worker(&workers[0]);
+    for(i = 1; i < started; i++) pthread_join(tids[i], NULL);
+
+    for(i = 0; i < threads; i++) {
+        pthread_mutex_destroy(&st.deques[i].lock);
+        free(st.deques[i].tasks);
+    }
+    free(st.deques);
+    pthread_cond_destroy(&st.idleCond);
+    pthread_mutex_destroy(&st.idleLock);
+    free(workers);
+    free(tids);
+    return st.visited;
+}
@@ -7,9 +7,9 @@
  * 
  * _OS_initialization(): initialize the environment
  * _OS_getEnt(const char *path): get the dirEnt of file "path"
- * _OS_read_file(unsigned int idxCluster, int offset, int length, void *buffer):
+ * _OS_read_file(uint32_t idxCluster, off_t offset, size_t length, void *buffer):
  *   read the content of a file starting at cluster "idxCluster"
- * _OS_write_file(unsigned int idxCluster, const void * buf, int nbytes, int offset):
+ * _OS_write_file(uint32_t idxCluster, const void * buf, size_t nbytes, off_t offset):
  *   write the content of buffer to a file start at cluster @idxCluster
  * _setFATvalue(uint32_t idx, uint32_t value): set the value of FAT entry @idx as @value
  * verify(const uint8_t *FATname, char *filename):
@@ -19,20 +19,67 @@
  * _get_parent_path(const char *path, char * filename): split the @path into parent path and 
  *   self name.
  * _findFirstEmptyClus(): find the first available cluster in the file system
+ * _findEmptyClusNear(uint32_t goal): find the first available cluster at or after @goal
+ * _spreadGoal(): where to place a new top level dir
+ * _allocClus(uint32_t goal): find a cluster for new data following the mount's placement
  * _remove_link(uint32_t idx): remove the link in FAT starting from @idx
  * _delete_dirEnt(const char *path, const uint8_t name[]): delete the dirEnt with name @name
+ * _dev_read(void *buf, size_t n, off_t pos) / _dev_write(const void *buf, size_t n, off_t pos):
+ *   positioned device access that does not move the shared file offset
+ * _clusterPos(uint32_t idxCluster): byte position of a data cluster on the device
+ * _getFATvalue(uint32_t idx): get the value of FAT entry @idx
+ * _get_extents(uint32_t idxCluster, uint32_t maxClus, int *n): split a chain into contiguous runs
+ * _copy_dev_to_fd(int out_fd, off_t pos, size_t len): copy a device range to a host file
+ * _findFreeRun(uint32_t count): find @count contiguous free clusters
+ * _findFreeRuns(uint32_t count, extent *runs, int maxRuns): find @count free clusters in a few large runs
+ * _setFATchain(uint32_t start, uint32_t count): link a contiguous run into one chain
+ * _free_extents(extent *ext, int n): free many runs of clusters with one write per FAT sector
+ * _add_dirEnt(const char *path, const dirEnt *ent): add @ent to the list of dir @path
+ * _free_slot(uint32_t idxCluster, bool *atEnd): the slot a new entry of a dir goes to
+ * _FAT2flnm(const uint8_t *FATname, char *filename): convert a FAT dir_name to a C string
+ * _read_dir_clus(uint32_t idxCluster, int *n): get the live entries of the dir at @idxCluster
+ * _read_dir_extents(const extent *ext, int numExt, int *n, off_t **slotPos): the same for a dir
+ *   given as runs of clusters, optionally with the device position of every entry
+ * _write_chain(uint32_t idxCluster, const void *buf, size_t nbytes, off_t offset, uint32_t *lastClus):
+ *   _OS_write_file that also reports the cluster holding the last byte written
+ * _flush_fd(int fd): write the buffered data of @fd, allocating clusters if it has none
+ * _flush_open(): _flush_fd every open fd, before the device is read around the fds
+ * _flush_all(): _flush_fd and _chain_trim every open fd, run at exit
+ * _write_fd(int fd, const void *buf, size_t len, off_t offset): write to the file of @fd
+ *   starting at the cached end of its chain when possible
+ * _place_fd(int fd, uint64_t reserve): give the file of @fd, which has no cluster yet, its clusters
+ * _chain_load(int fd), _chain_reserve(int fd, uint64_t end), _chain_trim(int fd): keep track
+ *   of the end of the chain of @fd, preallocate clusters past it and give them back
+ * _fd_open(const dirEnt *ent, uint32_t parentClus), _fd_get(int fd), _fd_close(int fd): the fd
+ *   table, whose fds share one openFile per open file
+ * _open_find(uint32_t clus): the open file starting at cluster @clus
+ * _open_slot(uint32_t parentClus, const uint8_t *name): the open file of entry @name in the dir at @parentClus
+ * _update_open(openFile *of): write the entry of an open file back to its remembered slot
+ * _open_move(uint32_t oldParent, const uint8_t *oldName, uint32_t newParent, const uint8_t *newName):
+ *   keep the open file of a renamed entry attached to it
+ * _geom_select(): pick the instance of the hot paths (read, write, FAT updates, extents)
+ *   compiled for the sector and cluster size of the mounted volume
  */
 
 
 
+#define _GNU_SOURCE
 #include "fat16_32.h"
 #include "fat32api.h"
 #include "utils32.h"
+#include "stats32.h"
+#include "trace32.h"
+#include "journal32.h"
+#include "index32.h"
+#include "dev32.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/sendfile.h>
 
 /// Verify that a C string filename equals to a FAT filename
 int verify(const uint8_t *FATname, char *filename);
@@ -49,63 +96,44 @@ void _initVirtualRootDirEnt(dirEnt * p){
 }
 
 
-int _OS_read_file(unsigned int idxCluster, int offset, int length, void * buffer)
-{
-    int beginLogicCluster = offset / _status.BytesPerCluster;
-    int beginOffset = offset % _status.BytesPerCluster;
-    int endLogicCluster = (offset + length + _status.BytesPerCluster - 1) / _status.BytesPerCluster;
-    int i = 0;
-    uint32_t * tmpbuffer = malloc(_status.BytesPerSec);
-    unsigned char * tmpDataBuffer = malloc(_status.BytesPerCluster);
-    int readCnt = 0;
-    int err_code = 0; // output code.
-    unsigned int tmpPhysicalCluster = idxCluster;
-    while(i < endLogicCluster){
-        //puts("reading");
-        // Check whether tmpPhysicalCluster is valid;
-        if(tmpPhysicalCluster == 0xFFFF) { // if not valid
-            err_code = -1; // output 1
-            break;
-        }
-        // if we should read, read the content to buffer;
-        if(i >= beginLogicCluster){
-            lseek(_status.device_fd, _status.startDataSec * _status.BytesPerSec
- + (tmpPhysicalCluster - 2) * _status.BytesPerCluster, SEEK_SET);
-            read(_status.device_fd, tmpDataBuffer, _status.BytesPerCluster);// read the current cluster to tmp buffer
-            if(i == beginLogicCluster){// if this is the begin cluster
-                if(endLogicCluster - beginLogicCluster == 1){ // if within one cluster
-                    memcpy(buffer+readCnt, tmpDataBuffer + beginOffset, length);
-                    readCnt += length;
-                } else { // if this is not the last cluster, copy all data to the end
-                    memcpy(buffer+readCnt, tmpDataBuffer + beginOffset,
-                        _status.BytesPerCluster - beginOffset);
-                    readCnt += _status.BytesPerCluster - beginOffset;
-                }
-            } else { // if this is not the begin cluster
-                if(endLogicCluster - i == 1){ // if this is the last cluster
-                    memcpy(buffer+readCnt, tmpDataBuffer, length - readCnt);
-                    readCnt = length;
-                } else {
-                    memcpy(buffer+readCnt, tmpDataBuffer, _status.BytesPerCluster);
-                    readCnt += _status.BytesPerCluster;
-                }
-            }
-        }
-        if(readCnt == length) {err_code = readCnt; break;} // if all data are read, break
+/*
+ * The hot paths below are written once as GEOM_BODY functions taking the sector size
+ * @bps and the cluster size @bpc as arguments. GEOM_VARIANT instantiates them with
+ * constant sizes, where the compiler turns every division and modulo into a shift or a
+ * mask and the FAT sector buffers get a fixed size; _geom_select picks the instance of
+ * the mounted volume once, and the generic instance serves any other geometry.
+ */
+#define GEOM_BODY static inline __attribute__((always_inline))
 
-        // update tmpPhysicalCluster
-        // calc where it is in FAT (in sector)
-        unsigned int posFATsec = _status.startFATSec +
-            (tmpPhysicalCluster * SIZE_FAT_ENTRY) / _status.BytesPerSec;
-        int posFAToffset = ((tmpPhysicalCluster * SIZE_FAT_ENTRY) % _status.BytesPerSec) / SIZE_FAT_ENTRY;
-        lseek(_status.device_fd, posFATsec * _status.BytesPerSec, SEEK_SET);
-        read(_status.device_fd,tmpbuffer,_status.BytesPerSec);
-        tmpPhysicalCluster = tmpbuffer[posFAToffset] & 0x0FFFFFFF; // get next cluster number
-        i++;
+/// byte position of data cluster @c
+#define GEOM_CLUSPOS(c, bps, bpc) ((off_t)_status.startDataSec * (bps) + (off_t)((c) - 2) * (bpc))
+
+GEOM_BODY extent * _get_extents_body(uint32_t idxCluster, uint32_t maxClus, int * n, const unsigned bps);
+GEOM_BODY int _setFATvalue_body(uint32_t idx, uint32_t value, const unsigned bps);
+
+GEOM_BODY ssize_t _read_file_body(uint32_t idxCluster, off_t offset, size_t length, void * buffer,
+                                  const unsigned bps, const unsigned bpc)
+{
+    if(length == 0) return 0;
+    uint32_t first = offset / bpc;
+    uint32_t last = (offset + length - 1) / bpc;
+    int numExt = 0;
+    extent * ext = _get_extents_body(idxCluster, last + 1, &numExt, bps);
+    size_t readCnt = 0;
+    uint32_t idx = 0; // logical number of the first cluster of the current run
+    int i;
+    // every run of contiguous clusters is read with one call, straight into @buffer
+    for(i = 0; i < numExt && readCnt < length; idx += ext[i].count, i++) {
+        if(idx + ext[i].count <= first) continue;
+        uint32_t skip = first > idx ? first - idx : 0;
+        size_t inClus = readCnt == 0 ? offset % bpc : 0;
+        size_t n = (size_t)(ext[i].count - skip) * bpc - inClus;
+        if(n > length - readCnt) n = length - readCnt;
+        if(_dev_read((char *)buffer + readCnt, n, GEOM_CLUSPOS(ext[i].start + skip, bps, bpc) + inClus) != n) break;
+        readCnt += n;
     }
-    free(tmpbuffer);
-    free(tmpDataBuffer);
-    return err_code;
+    free(ext);
+    return readCnt == length ? (ssize_t)readCnt : -1;
 }
 
 /**
@@ -174,6 +202,16 @@ int flnm2FAT(const char * filename, unsigned char *FATname) {
 
 /// get the dirEnt of the specified file/dir
 dirEnt * _OS_getEnt(const char * path){
+    if(_status.readOnly) { // once the index is built, lookups need no device I/O
+        dirEnt found;
+        int r = _index_getEnt(path, &found);
+        if(r == 0) return NULL;
+        if(r == 1) {
+            dirEnt * output = malloc(sizeof(dirEnt));
+            *output = found;
+            return output;
+        }
+    }
     const char *p = path;
     dirEnt tmpdir = *_status.curdir; /*tmp dir in searching*/
     dirEnt * buf = malloc(_status.BytesPerCluster); /*temporary buffer*/
@@ -209,6 +247,7 @@ dirEnt * _OS_getEnt(const char * path){
                 bool endOfDirectory = false;
                 for( ; true ; i++) {
                     _OS_read_file(_status.idxRootDirClus, i * _status.BytesPerCluster, _status.BytesPerCluster, buf);
+                    STAT_ADD(dirClusScanned, 1);
                     int j = 0;
                     for( ; j < _status.BytesPerCluster / sizeof(dirEnt); j++){
                         if(buf[j].dir_name[0]=='\0') {
@@ -240,6 +279,7 @@ dirEnt * _OS_getEnt(const char * path){
             bool endOfDirectory=0;
             for( ; true ; i++){
                 _OS_read_file(fstCluster, i * _status.BytesPerCluster, _status.BytesPerCluster, buf);
+                STAT_ADD(dirClusScanned, 1);
                 int j = 0;
 
                 for( ; j < _status.BytesPerCluster / sizeof(dirEnt); j++){
@@ -300,30 +340,31 @@ char * _get_parent_path(const char *path, char * filename) {
 }
 
 
-int _OS_write_file(unsigned int idxCluster, const void * buf, int nbytes, int offset)
+ssize_t _OS_write_file(uint32_t idxCluster, const void * buf, size_t nbytes, off_t offset)
 {
-    unsigned int beginLogicCluster = offset / _status.BytesPerCluster;
-    unsigned int beginOffset = offset % _status.BytesPerCluster;
-    unsigned int endLogicCluster = (offset + nbytes + _status.BytesPerCluster - 1) / _status.BytesPerCluster;
-    uint32_t * tmpFATbuffer = malloc(_status.BytesPerSec); // buffer storing FAT entries
-    unsigned char * tmpDataBuffer = malloc(_status.BytesPerCluster); // buffer storing data
-    unsigned int i = 0; // current logic cluster number
-    int writeCnt = 0; // how many bytes are written
-    int err_code = 0; // output code.
-    unsigned int tmpPhysicalCluster = idxCluster;
+    return _write_chain(idxCluster, buf, nbytes, offset, NULL);
+}
+
+GEOM_BODY ssize_t _write_chain_body(uint32_t idxCluster, const void * buf, size_t nbytes, off_t offset,
+                                    uint32_t * lastClus, const unsigned bps, const unsigned bpc)
+{
+    uint32_t beginLogicCluster = offset / bpc;
+    uint32_t beginOffset = offset % bpc;
+    uint32_t endLogicCluster = ((uint64_t)offset + nbytes + bpc - 1) / bpc;
+    uint32_t tmpFATbuffer[bps / SIZE_FAT_ENTRY]; // buffer storing FAT entries
+    uint32_t cachedFATsec = 0; // sector held by tmpFATbuffer, 0 for none (it is never a FAT sector)
+    unsigned char * tmpDataBuffer = malloc(bpc); // buffer storing data
+    uint32_t i = 0; // current logic cluster number
+    size_t writeCnt = 0; // how many bytes are written
+    ssize_t err_code = 0; // output code.
+    uint32_t tmpPhysicalCluster = idxCluster;
     while(i < endLogicCluster){
 
         // if we should write, write the content to buffer;
         if(i >= beginLogicCluster){
-            lseek(_status.device_fd, _status.startDataSec * _status.BytesPerSec
- + (tmpPhysicalCluster - 2) * _status.BytesPerCluster, SEEK_SET);
-
-            // read the current cluster to buffer
-            read(_status.device_fd, tmpDataBuffer, _status.BytesPerCluster);// read the current cluster to tmp buffer
-
-            // relocate the reading/writing pointer
-            lseek(_status.device_fd, _status.startDataSec * _status.BytesPerSec
- + (tmpPhysicalCluster - 2) * _status.BytesPerCluster, SEEK_SET);
+            // read the current cluster to buffer, unless all of it is overwritten
+            bool whole = (i != beginLogicCluster || beginOffset == 0) && nbytes - writeCnt >= bpc;
+            if(!whole) _dev_read(tmpDataBuffer, bpc, GEOM_CLUSPOS(tmpPhysicalCluster, bps, bpc));
             if(i == beginLogicCluster){// if this is the begin cluster
                 if(endLogicCluster - beginLogicCluster == 1){ // if within one cluster
                     memcpy(tmpDataBuffer + beginOffset, buf+writeCnt,  nbytes);
@@ -331,42 +372,48 @@ int _OS_write_file(unsigned int idxCluster, const void * buf, int nbytes, int of
 
                 } else { // if this is not the last cluster, copy all data to the end
                     memcpy(tmpDataBuffer + beginOffset, buf+writeCnt,
-                        _status.BytesPerCluster - beginOffset);
-                    writeCnt += _status.BytesPerCluster - beginOffset;
+                        bpc - beginOffset);
+                    writeCnt += bpc - beginOffset;
                 }
             } else { // if this is not the begin cluster
                 if(endLogicCluster - i == 1){ // if this is the last cluster
                     memcpy(tmpDataBuffer, buf + writeCnt,  nbytes - writeCnt);
                     writeCnt = nbytes;
                 } else {
-                    memcpy(tmpDataBuffer, buf + writeCnt,  _status.BytesPerCluster);
-                    writeCnt += _status.BytesPerCluster;
+                    memcpy(tmpDataBuffer, buf + writeCnt,  bpc);
+                    writeCnt += bpc;
                 }
             }
 
             //write the buffer to disk
-            write(_status.device_fd, tmpDataBuffer, _status.BytesPerCluster);
+            _dev_write(tmpDataBuffer, bpc, GEOM_CLUSPOS(tmpPhysicalCluster, bps, bpc));
+        }
+        if(writeCnt == nbytes) { // if all data are written, break
+            err_code = writeCnt;
+            if(lastClus) *lastClus = tmpPhysicalCluster;
+            break;
         }
-        if(writeCnt == nbytes) {err_code = writeCnt; break;} // if all data are read, break
 
         // update tmpPhysicalCluster
         // calc where it is in FAT (in sector)
-        unsigned int posFATsec = _status.startFATSec +
-            (tmpPhysicalCluster * SIZE_FAT_ENTRY) / _status.BytesPerSec;
+        uint32_t posFATsec = _status.startFATSec +
+            (tmpPhysicalCluster * SIZE_FAT_ENTRY) / bps;
 
         // calculate the offset in this sector
-        int posFAToffset = (tmpPhysicalCluster * SIZE_FAT_ENTRY) % _status.BytesPerSec / SIZE_FAT_ENTRY;
+        int posFAToffset = (tmpPhysicalCluster * SIZE_FAT_ENTRY) % bps / SIZE_FAT_ENTRY;
 
-        // read this sector
-        lseek(_status.device_fd, posFATsec * _status.BytesPerSec, SEEK_SET);
-        read(_status.device_fd,tmpFATbuffer,_status.BytesPerSec);
+        // read this sector, unless the previous cluster was in it as well
+        if(posFATsec != cachedFATsec) {
+            _dev_read(tmpFATbuffer, bps, (off_t)posFATsec * bps);
+            cachedFATsec = posFATsec;
+        }
 
          // get next cluster number
         uint32_t newPhysicaCluster = ( tmpFATbuffer[posFAToffset] & 0x0FFFFFFF );
 
         // if reach the end of the file, try to allocate more space
         if(newPhysicaCluster == 0x0FFFFFFF) {
-            newPhysicaCluster = _findFirstEmptyClus();
+            newPhysicaCluster = _allocClus(tmpPhysicalCluster + 1);
 
             // if cannot allocate cluster, abort
             if(newPhysicaCluster == 0) {
@@ -374,8 +421,9 @@ int _OS_write_file(unsigned int idxCluster, const void * buf, int nbytes, int of
                 break;
             } else {
                 // save this newly allocated cluster to FAT
-                _setFATvalue(tmpPhysicalCluster, newPhysicaCluster);
-                _setFATvalue(newPhysicaCluster, 0xFFFFFFFF);
+                _setFATvalue_body(tmpPhysicalCluster, newPhysicaCluster, bps);
+                _setFATvalue_body(newPhysicaCluster, 0xFFFFFFFF, bps);
+                cachedFATsec = 0;
                 tmpPhysicalCluster = newPhysicaCluster;
             }
         } else {
@@ -384,7 +432,6 @@ int _OS_write_file(unsigned int idxCluster, const void * buf, int nbytes, int of
         }
         i++;
     }
-    free(tmpFATbuffer);
     free(tmpDataBuffer);
     return err_code;
 }
@@ -395,12 +442,12 @@ int _OS_write_file(unsigned int idxCluster, const void * buf, int nbytes, int of
  * return 0 if not succeed
  * */
 unsigned int _findFirstEmptyClus() {
+    _journal_alloc(); // clusters freed by an uncommitted group are not free yet
     uint32_t * buf = malloc(_status.BytesPerSec);
     unsigned int i = 0;
-    lseek(_status.device_fd, _status.BytesPerSec * _status.startFATSec, SEEK_SET);
     unsigned int result = 0;
     for( ; i < _status.FATSz; i++) { // go over all FAT entries
-        read(_status.device_fd, buf, _status.BytesPerSec);
+        _dev_read(buf, _status.BytesPerSec, (off_t)(_status.startFATSec + i) * _status.BytesPerSec);
         int j = 0;
         for( ; j < _status.BytesPerSec / SIZE_FAT_ENTRY; j++) {
             if(buf[j] == 0) {
@@ -415,52 +462,106 @@ unsigned int _findFirstEmptyClus() {
     return result;
 }
 
+/*
+ * Find the first empty cluster at or after @goal, wrapping around at the end of the FAT
+ * return cluster (>=2) index if succeed
+ * return 0 if not succeed
+ * */
+uint32_t _findEmptyClusNear(uint32_t goal) {
+    _journal_alloc();
+    const uint32_t entPerRead = FAT_SCAN_SECS * _status.BytesPerSec / SIZE_FAT_ENTRY;
+    uint32_t * buf = malloc(FAT_SCAN_SECS * _status.BytesPerSec);
+    if(goal < 2 || goal >= _status.totalClus) goal = 2;
+    uint32_t result = 0;
+    uint32_t scanned = 0;
+    uint32_t base = goal - goal % entPerRead;
+    while(result == 0 && scanned < _status.totalClus + entPerRead) {
+        _dev_read(buf, FAT_SCAN_SECS * _status.BytesPerSec,
+            (off_t)_status.startFATSec * _status.BytesPerSec + (off_t)base * SIZE_FAT_ENTRY);
+        uint32_t j = scanned == 0 ? goal - base : 0;
+        for( ; j < entPerRead && base + j < _status.totalClus; j++) {
+            if(base + j >= 2 && (buf[j] & 0x0FFFFFFF) == 0) {
+                result = base + j;
+                break;
+            }
+        }
+        scanned += entPerRead;
+        base += entPerRead;
+        if(base >= _status.totalClus) base = 0;
+    }
+    free(buf);
+    return result;
+}
+
+/*
+ * Orlov style spreading: split the volume in groups of FAT_SCAN_SECS FAT sectors and
+ * return the first cluster of the group with the most free clusters, so unrelated top
+ * level trees start far from each other and each has room to grow.
+ * */
+uint32_t _spreadGoal() {
+    const uint32_t entPerRead = FAT_SCAN_SECS * _status.BytesPerSec / SIZE_FAT_ENTRY;
+    uint32_t * buf = malloc(FAT_SCAN_SECS * _status.BytesPerSec);
+    uint32_t best = 2, bestFree = 0;
+    uint32_t base;
+    for(base = 0; base < _status.totalClus; base += entPerRead) {
+        _dev_read(buf, FAT_SCAN_SECS * _status.BytesPerSec,
+            (off_t)_status.startFATSec * _status.BytesPerSec + (off_t)base * SIZE_FAT_ENTRY);
+        uint32_t j, numFree = 0;
+        for(j = 0; j < entPerRead && base + j < _status.totalClus; j++)
+            if(base + j >= 2 && (buf[j] & 0x0FFFFFFF) == 0) numFree++;
+        if(numFree > bestFree) {
+            bestFree = numFree;
+            best = base < 2 ? 2 : base;
+        }
+    }
+    free(buf);
+    return best;
+}
+
+/// find a free cluster for new data wanted near @goal, 0 if the volume is full
+uint32_t _allocClus(uint32_t goal) {
+    if(_status.placement == PLACE_NEAR) return _findEmptyClusNear(goal);
+    return _findFirstEmptyClus();
+}
+
 
 /**
  * set the FAT entry @idx to value @value
  * */
-int _setFATvalue(uint32_t idx, uint32_t value) {
+GEOM_BODY int _setFATvalue_body(uint32_t idx, uint32_t value, const unsigned bps) {
     unsigned int posFATsec = _status.startFATSec +
-        (idx * SIZE_FAT_ENTRY) / _status.BytesPerSec;
-    int posFAToffset = ((idx * SIZE_FAT_ENTRY) % _status.BytesPerSec) / SIZE_FAT_ENTRY;
+        (idx * SIZE_FAT_ENTRY) / bps;
+    int posFAToffset = ((idx * SIZE_FAT_ENTRY) % bps) / SIZE_FAT_ENTRY;
     int i;
-    uint32_t * buf = malloc(_status.BytesPerSec);
-    if(buf == NULL) return 1;
+    uint32_t buf[bps / SIZE_FAT_ENTRY];
 
     // change all FATs
     for(i = 0; i < _status.numFAT; i++){
 
-        lseek(_status.device_fd, posFATsec * _status.BytesPerSec, SEEK_SET);
-        read(_status.device_fd, buf, _status.BytesPerSec);
+        _dev_read(buf, bps, (off_t)posFATsec * bps);
         uint32_t tmp = buf[posFAToffset] & 0xF0000000;
+        if(i == 0) _stat_count_fat_change(buf[posFAToffset] & 0x0FFFFFFF, value & 0x0FFFFFFF);
         buf[posFAToffset] = tmp + (value & 0x0FFFFFFF);
 
-        lseek(_status.device_fd, posFATsec * _status.BytesPerSec, SEEK_SET);
-        write(_status.device_fd, buf, _status.BytesPerSec);
+        _dev_write(buf, bps, (off_t)posFATsec * bps);
         posFATsec += _status.FATSz;
     }
-    free(buf);
     return 0;
 }
 
 /// remove the link in FAT starting from @idx
-int _remove_link(uint32_t idx) {
-    uint32_t * buf = malloc(_status.BytesPerSec);
+GEOM_BODY int _remove_link_body(uint32_t idx, const unsigned bps) {
+    uint32_t buf[bps / SIZE_FAT_ENTRY];
     uint32_t curidx = idx;
     while( (curidx & 0x0FFFFFFF) != 0x0FFFFFFF && curidx != 0) {
         uint32_t posFATsec = _status.startFATSec +
-            (curidx * SIZE_FAT_ENTRY) / _status.BytesPerSec;
-        int posFAToffset = ((idx * SIZE_FAT_ENTRY) % _status.BytesPerSec) / SIZE_FAT_ENTRY;
-        lseek(_status.device_fd, posFATsec * _status.BytesPerSec, SEEK_SET);
-        read(_status.device_fd, buf, _status.BytesPerSec);
+            (curidx * SIZE_FAT_ENTRY) / bps;
+        int posFAToffset = ((curidx * SIZE_FAT_ENTRY) % bps) / SIZE_FAT_ENTRY;
+        _dev_read(buf, bps, (off_t)posFATsec * bps);
         uint32_t newidx = buf[posFAToffset];
-        _setFATvalue(curidx,0);
+        _setFATvalue_body(curidx, 0, bps);
         curidx = newidx & 0x0FFFFFFF;
-        /*buf[posFAToffset] = 0;
-        lseek(_status.device_fd, posFATsec * _status.BytesPerSec, SEEK_SET);
-        write(_status.device_fd, buf, _status.BytesPerSec);*/
     }
-    free(buf);
     return 0;
 }
 
@@ -476,6 +577,7 @@ int _update_dirEnt(uint32_t idxCluster, dirEnt * ptr) {
     int i = 0;
     for( ; !found; i++) {
         _OS_read_file(idxCluster, i * _status.BytesPerCluster, _status.BytesPerCluster, buf);
+        STAT_ADD(dirClusScanned, 1);
         int j = 0;
         bool reach_end = false;
         for( ; j < _status.BytesPerCluster / sizeof(dirEnt); j++) {
@@ -517,9 +619,20 @@ int _delete_dirEnt(const char *path, const uint8_t name[]) {
     {
         if(strncmp((const char *)dir_content[i].dir_name, (const char *)name, 11) == 0)
         {
-            dir_content[i].dir_name[0] = 0xE5;
-            _OS_write_file(start_idx, & dir_content[i], sizeof(dirEnt), i * sizeof(dirEnt));
             found = true;
+            if(dir_content[i + 1].dir_name[0] != '\0') {
+                dir_content[i].dir_name[0] = 0xE5;
+                _OS_write_file(start_idx, & dir_content[i], sizeof(dirEnt), i * sizeof(dirEnt));
+                break;
+            }
+            // the last entry: it becomes the end marker, then so do the deleted slots before it,
+            // so scans of the dir stop early; each write leaves a valid list behind
+            int first = i;
+            while(first > 0 && dir_content[first - 1].dir_name[0] == 0xE5) first--;
+            memset(&dir_content[first], 0, (i - first + 1) * sizeof(dirEnt));
+            _OS_write_file(start_idx, & dir_content[i], sizeof(dirEnt), i * sizeof(dirEnt));
+            if(first < i)
+                _OS_write_file(start_idx, & dir_content[first], (i - first) * sizeof(dirEnt), first * sizeof(dirEnt));
             break;
         }
     }
@@ -527,3 +640,871 @@ int _delete_dirEnt(const char *path, const uint8_t name[]) {
     free(my_dirEnt);
     return found ? 0 : 1;
 }
+
+ssize_t _dev_read(void * buf, size_t n, off_t pos) {
+    size_t done = 0;
+    while(done < n) {
+        ssize_t r = _status.dev->read((char *)buf + done, n - done, pos + done);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        _stat_count_dev(false, r, pos + done);
+        _trace_dev(false, r, pos + done);
+        done += r;
+    }
+    _journal_read(buf, done, pos);
+    return done;
+}
+
+ssize_t _dev_write(const void * buf, size_t n, off_t pos) {
+    if(_journal_write(buf, n, pos)) return n;
+    size_t done = 0;
+    while(done < n) {
+        ssize_t r = _status.dev->write((const char *)buf + done, n - done, pos + done);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        _stat_count_dev(true, r, pos + done);
+        _trace_dev(true, r, pos + done);
+        done += r;
+    }
+    return done;
+}
+
+off_t _clusterPos(uint32_t idxCluster) {
+    return (off_t)_status.startDataSec * _status.BytesPerSec
+        + (off_t)(idxCluster - 2) * _status.BytesPerCluster;
+}
+
+uint32_t _getFATvalue(uint32_t idx) {
+    uint32_t value = 0;
+    off_t pos = (off_t)_status.startFATSec * _status.BytesPerSec + (off_t)idx * SIZE_FAT_ENTRY;
+    if(_dev_read(&value, SIZE_FAT_ENTRY, pos) != SIZE_FAT_ENTRY) return 0;
+    return value & 0x0FFFFFFF;
+}
+
+/**
+ * walk the chain starting at @idxCluster and merge physically adjacent clusters into runs.
+ * at most @maxClus clusters are visited (0 means the whole chain, bounded by the volume).
+ * the FAT sector of the previous cluster is kept, so a chain costs one read per FAT sector
+ * it crosses rather than one per cluster.
+ * @return array of extents (caller frees), *n receives its length
+ */
+GEOM_BODY extent * _get_extents_body(uint32_t idxCluster, uint32_t maxClus, int * n, const unsigned bps) {
+    const uint32_t entPerSec = bps / SIZE_FAT_ENTRY;
+    uint32_t fatbuf[entPerSec];
+    int vol = 8;
+    extent * res = malloc(vol * sizeof(extent));
+    uint32_t cachedSec = 0xFFFFFFFF;
+    uint32_t cur = idxCluster;
+    uint32_t visited = 0;
+    *n = 0;
+    // a chain can never be longer than the volume, this also stops on loops
+    if(maxClus == 0 || maxClus > _status.totalClus) maxClus = _status.totalClus;
+    while(cur >= 2 && cur < _status.totalClus && visited < maxClus) {
+        if(*n > 0 && res[*n - 1].start + res[*n - 1].count == cur) {
+            res[*n - 1].count++;
+        } else {
+            if(*n == vol) {
+                vol *= 2;
+                res = realloc(res, vol * sizeof(extent));
+            }
+            res[*n].start = cur;
+            res[*n].count = 1;
+            (*n)++;
+        }
+        visited++;
+        uint32_t sec = cur / entPerSec;
+        if(sec != cachedSec) {
+            STAT_ADD(cacheMisses, 1);
+            if(_dev_read(fatbuf, bps, (off_t)(_status.startFATSec + sec) * bps) != bps)
+                break;
+            cachedSec = sec;
+        } else {
+            STAT_ADD(cacheHits, 1);
+        }
+        cur = fatbuf[cur % entPerSec] & 0x0FFFFFFF;
+    }
+    return res;
+}
+
+/// the hot paths, instantiated per geometry
+typedef struct {
+    ssize_t (*readFile)(uint32_t idxCluster, off_t offset, size_t length, void * buffer);
+    ssize_t (*writeChain)(uint32_t idxCluster, const void * buf, size_t nbytes, off_t offset, uint32_t * lastClus);
+    int (*setFATvalue)(uint32_t idx, uint32_t value);
+    int (*removeLink)(uint32_t idx);
+    extent * (*getExtents)(uint32_t idxCluster, uint32_t maxClus, int * n);
+} geomOps;
+
+#define GEOM_VARIANT(name, bps, bpc) \
+    static ssize_t _read_file_##name(uint32_t c, off_t o, size_t l, void * b) \
+        { return _read_file_body(c, o, l, b, bps, bpc); } \
+    static ssize_t _write_chain_##name(uint32_t c, const void * b, size_t l, off_t o, uint32_t * last) \
+        { return _write_chain_body(c, b, l, o, last, bps, bpc); } \
+    static int _setFATvalue_##name(uint32_t idx, uint32_t value) \
+        { return _setFATvalue_body(idx, value, bps); } \
+    static int _remove_link_##name(uint32_t idx) \
+        { return _remove_link_body(idx, bps); } \
+    static extent * _get_extents_##name(uint32_t c, uint32_t maxClus, int * n) \
+        { return _get_extents_body(c, maxClus, n, bps); } \
+    static const geomOps _geom_##name = { _read_file_##name, _write_chain_##name, \
+        _setFATvalue_##name, _remove_link_##name, _get_extents_##name };
+
+GEOM_VARIANT(generic, _status.BytesPerSec, _status.BytesPerCluster)
+GEOM_VARIANT(512_4k, 512, 4096)
+GEOM_VARIANT(512_8k, 512, 8192)
+GEOM_VARIANT(512_16k, 512, 16384)
+GEOM_VARIANT(512_32k, 512, 32768)
+
+static const geomOps * _geom = &_geom_generic;
+
+/**
+ * pick the instance of the hot paths for the geometry of the mounted volume
+ * @return true if a specialized instance was found, false if the generic one is used
+ */
+bool _geom_select() {
+    _geom = &_geom_generic;
+    if(_status.BytesPerSec != 512) return false;
+    switch(_status.BytesPerCluster) {
+        case 4096: _geom = &_geom_512_4k; break;
+        case 8192: _geom = &_geom_512_8k; break;
+        case 16384: _geom = &_geom_512_16k; break;
+        case 32768: _geom = &_geom_512_32k; break;
+        default: return false;
+    }
+    return true;
+}
+
+ssize_t _OS_read_file(uint32_t idxCluster, off_t offset, size_t length, void * buffer) {
+    return _geom->readFile(idxCluster, offset, length, buffer);
+}
+
+ssize_t _write_chain(uint32_t idxCluster, const void * buf, size_t nbytes, off_t offset, uint32_t * lastClus) {
+    return _geom->writeChain(idxCluster, buf, nbytes, offset, lastClus);
+}
+
+int _setFATvalue(uint32_t idx, uint32_t value) {
+    return _geom->setFATvalue(idx, value);
+}
+
+int _remove_link(uint32_t idx) {
+    return _geom->removeLink(idx);
+}
+
+extent * _get_extents(uint32_t idxCluster, uint32_t maxClus, int * n) {
+    extent * ext = _status.readOnly ? _index_extents(idxCluster, maxClus, n) : NULL;
+    return ext ? ext : _geom->getExtents(idxCluster, maxClus, n);
+}
+
+/**
+ * copy @len bytes at device position @pos to the current position of @out_fd.
+ * copy_file_range keeps the data inside the kernel; sendfile covers the cases it
+ * refuses (older kernels, different file systems). If neither works we fall back to
+ * two alternating fixed buffers, asking the kernel to prefetch the next chunk before
+ * writing the current one so device reads overlap with host writes.
+ * @return number of bytes copied
+ */
+size_t _copy_dev_to_fd(int out_fd, off_t pos, size_t len) {
+    size_t done = 0;
+    // the ram backend has no fd and the direct one needs aligned transfers: both take the buffers
+    bool kernel = _status.dev->kernelCopy;
+    while(kernel && done < len) {
+        off_t in_off = pos + done;
+        ssize_t r = copy_file_range(_status.device_fd, &in_off, out_fd, NULL, len - done, 0);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        _stat_count_dev(false, r, pos + done);
+        _trace_dev(false, r, pos + done);
+        done += r;
+    }
+    while(kernel && done < len) {
+        off_t in_off = pos + done;
+        ssize_t r = sendfile(out_fd, _status.device_fd, &in_off, len - done);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        _stat_count_dev(false, r, pos + done);
+        _trace_dev(false, r, pos + done);
+        done += r;
+    }
+    if(done == len) return done;
+
+    const size_t chunk = COPY_CHUNK_SIZE;
+    unsigned char * bufs[2] = {malloc(chunk), malloc(chunk)};
+    int cur = 0;
+    size_t n = len - done < chunk ? len - done : chunk;
+    if(_dev_read(bufs[cur], n, pos + done) != n) n = 0;
+    while(n > 0) {
+        size_t next_off = done + n;
+        size_t next_n = len - next_off < chunk ? len - next_off : chunk;
+        if(next_n > 0 && kernel)
+            posix_fadvise(_status.device_fd, pos + next_off, next_n, POSIX_FADV_WILLNEED);
+        size_t w = 0;
+        while(w < n) {
+            ssize_t r = write(out_fd, bufs[cur] + w, n - w);
+            if(r < 0 && errno == EINTR) continue;
+            if(r <= 0) break;
+            w += r;
+        }
+        done += w;
+        if(w < n || next_n == 0) break;
+        cur ^= 1;
+        n = _dev_read(bufs[cur], next_n, pos + next_off) == next_n ? next_n : 0;
+    }
+    free(bufs[0]);
+    free(bufs[1]);
+    return done;
+}
+
+/*
+ * Find the first run of @count free clusters
+ * the FAT is read FAT_SCAN_SECS sectors at a time
+ * return the first cluster of the run if succeed
+ * return 0 if not succeed
+ * */
+uint32_t _findFreeRun(uint32_t count) {
+    _journal_alloc();
+    const uint32_t entPerRead = FAT_SCAN_SECS * _status.BytesPerSec / SIZE_FAT_ENTRY;
+    uint32_t * buf = malloc(FAT_SCAN_SECS * _status.BytesPerSec);
+    uint32_t runStart = 0, runLen = 0;
+    uint32_t base;
+    for(base = 0; base < _status.totalClus && runLen < count; base += entPerRead) {
+        _dev_read(buf, FAT_SCAN_SECS * _status.BytesPerSec,
+            (off_t)_status.startFATSec * _status.BytesPerSec + (off_t)base * SIZE_FAT_ENTRY);
+        uint32_t j;
+        for(j = 0; j < entPerRead && base + j < _status.totalClus; j++) {
+            uint32_t idx = base + j;
+            if(idx < 2 || (buf[j] & 0x0FFFFFFF) != 0) {
+                runLen = 0;
+                continue;
+            }
+            if(runLen == 0) runStart = idx;
+            if(++runLen == count) break;
+        }
+    }
+    free(buf);
+    return runLen == count ? runStart : 0;
+}
+
+/*
+ * Find @count free clusters in at most @maxRuns runs, taking the largest free runs of the
+ * volume first, for data that fits in no single run
+ * the FAT is read FAT_SCAN_SECS sectors at a time
+ * return the number of runs put in @runs, ordered by cluster, the last one cut to what is needed
+ * return 0 if the @maxRuns largest runs are not enough
+ * */
+int _findFreeRuns(uint32_t count, extent * runs, int maxRuns) {
+    _journal_alloc();
+    const uint32_t entPerRead = FAT_SCAN_SECS * _status.BytesPerSec / SIZE_FAT_ENTRY;
+    uint32_t * buf = malloc(FAT_SCAN_SECS * _status.BytesPerSec);
+    uint32_t runStart = 0, runLen = 0;
+    int n = 0, i; // @runs keeps the largest runs seen so far, largest first
+    uint32_t base;
+    for(base = 0; base < _status.totalClus; base += entPerRead) {
+        _dev_read(buf, FAT_SCAN_SECS * _status.BytesPerSec,
+            (off_t)_status.startFATSec * _status.BytesPerSec + (off_t)base * SIZE_FAT_ENTRY);
+        uint32_t j;
+        for(j = 0; j <= entPerRead; j++) {
+            uint32_t idx = base + j;
+            bool isFree = j < entPerRead && idx < _status.totalClus && idx >= 2 && (buf[j] & 0x0FFFFFFF) == 0;
+            if(isFree) {
+                if(runLen++ == 0) runStart = idx;
+                continue;
+            }
+            // a run ends here, unless it goes on in the next read
+            if(runLen == 0 || (j == entPerRead && idx < _status.totalClus)) continue;
+            for(i = n < maxRuns ? n++ : maxRuns; i > 0 && runs[i - 1].count < runLen; i--) {
+                if(i < maxRuns) runs[i] = runs[i - 1];
+            }
+            if(i < maxRuns) runs[i] = (extent){runStart, runLen};
+            runLen = 0;
+            if(idx >= _status.totalClus) break;
+        }
+    }
+    free(buf);
+    uint32_t total = 0;
+    for(i = 0; i < n && total < count; i++) total += runs[i].count;
+    if(total < count) return 0;
+    n = i;
+    runs[n - 1].count -= total - count;
+    // front to back, so the file is read in one sweep
+    for(i = 1; i < n; i++) {
+        extent e = runs[i];
+        int k;
+        for(k = i; k > 0 && runs[k - 1].start > e.start; k--) runs[k] = runs[k - 1];
+        runs[k] = e;
+    }
+    return n;
+}
+
+/**
+ * link clusters @start .. @start + @count - 1 into one chain ended by EOC
+ * every FAT sector touched is read and written once per FAT
+ * @return 0 if success, 1 if failure
+ */
+int _setFATchain(uint32_t start, uint32_t count) {
+    const uint32_t entPerSec = _status.BytesPerSec / SIZE_FAT_ENTRY;
+    uint32_t * buf = malloc(_status.BytesPerSec);
+    if(buf == NULL) return 1;
+    uint32_t end = start + count; // one past the last cluster
+    uint32_t sec;
+    for(sec = start / entPerSec; sec <= (end - 1) / entPerSec; sec++) {
+        int i;
+        for(i = 0; i < _status.numFAT; i++) {
+            off_t pos = (off_t)(_status.startFATSec + (uint32_t)i * _status.FATSz + sec) * _status.BytesPerSec;
+            _dev_read(buf, _status.BytesPerSec, pos);
+            uint32_t idx = sec * entPerSec < start ? start : sec * entPerSec;
+            for( ; idx < end && idx < (sec + 1) * entPerSec; idx++) {
+                uint32_t value = idx + 1 == end ? 0x0FFFFFFF : idx + 1;
+                if(i == 0) _stat_count_fat_change(buf[idx % entPerSec] & 0x0FFFFFFF, value);
+                buf[idx % entPerSec] = (buf[idx % entPerSec] & 0xF0000000) + value;
+            }
+            _dev_write(buf, _status.BytesPerSec, pos);
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+static int _cmp_extent(const void * a, const void * b) {
+    uint32_t x = ((const extent *)a)->start, y = ((const extent *)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * free all clusters of the runs @ext[0 .. @n - 1], which may come from any number of chains.
+ * the runs are sorted by cluster first, so every FAT sector they touch is read and written
+ * once per FAT instead of once per cluster. @ext is reordered, merged and trimmed on the way.
+ * @return 0 if succeed, 1 if fail
+ */
+int _free_extents(extent * ext, int n) {
+    const uint32_t entPerSec = _status.BytesPerSec / SIZE_FAT_ENTRY;
+    uint32_t * buf = malloc(_status.BytesPerSec);
+    if(buf == NULL) return 1;
+    qsort(ext, n, sizeof(extent), _cmp_extent);
+    // cross-linked chains give overlapping runs: merge them so every cluster is in one run
+    int e, m = 0;
+    for(e = 0; e < n; e++) {
+        if(ext[e].count == 0) continue;
+        if(m > 0 && ext[e].start <= ext[m - 1].start + ext[m - 1].count) {
+            uint32_t end = ext[e].start + ext[e].count;
+            if(end > ext[m - 1].start + ext[m - 1].count) ext[m - 1].count = end - ext[m - 1].start;
+        } else {
+            ext[m++] = ext[e];
+        }
+    }
+    n = m;
+    e = 0;
+    while(e < n) {
+        uint32_t sec = ext[e].start / entPerSec;
+        uint32_t secEnd = (sec + 1) * entPerSec; // first cluster of the next sector
+        int i;
+        for(i = 0; i < _status.numFAT; i++) {
+            off_t pos = (off_t)(_status.startFATSec + (uint32_t)i * _status.FATSz + sec) * _status.BytesPerSec;
+            _dev_read(buf, _status.BytesPerSec, pos);
+            int k;
+            for(k = e; k < n && ext[k].start < secEnd; k++) {
+                uint32_t idx = ext[k].start;
+                for( ; idx < ext[k].start + ext[k].count && idx < secEnd; idx++) {
+                    if(i == 0) _stat_count_fat_change(buf[idx % entPerSec] & 0x0FFFFFFF, 0);
+                    buf[idx % entPerSec] &= 0xF0000000;
+                }
+            }
+            _dev_write(buf, _status.BytesPerSec, pos);
+        }
+        // the runs are disjoint, only the last one in this sector can go on past it
+        while(e < n && ext[e].start + ext[e].count <= secEnd) e++;
+        if(e < n && ext[e].start < secEnd) {
+            ext[e].count -= secEnd - ext[e].start;
+            ext[e].start = secEnd;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+/**
+ * add the entry @ent to the list of dir @path
+ * the first free slot (never used or deleted) is taken, the list is
+ * terminated again if the end marker was consumed
+ * @return 0 if succeed, 1 if fail
+ */
+int _add_dirEnt(const char *path, const dirEnt * ent) {
+    dirEnt * my_dirEnt = _OS_getEnt(path);
+    if(my_dirEnt == NULL) return 1;
+    uint32_t start_idx = my_dirEnt->dir_fstClusLO + ( (uint32_t)my_dirEnt->dir_fstClusHI << 16);
+    free(my_dirEnt);
+
+    // if this path is the root dir, then we set @start_idx correctly
+    if(start_idx==0) start_idx = _status.idxRootDirClus;
+
+    bool atEnd;
+    int i = _free_slot(start_idx, &atEnd);
+    int num_ent_write = atEnd ? 2 : 1;
+
+    dirEnt append_ent[2];
+    memset(append_ent, 0, 2 * sizeof(dirEnt));
+    append_ent[0] = *ent;
+    int written = _OS_write_file(start_idx, append_ent, num_ent_write * sizeof(dirEnt), i * sizeof(dirEnt));
+    return written == num_ent_write * sizeof(dirEnt) ? 0 : 1;
+}
+
+/**
+ * the slot a new entry of the dir starting at @idxCluster goes to: the first deleted slot,
+ * otherwise the end marker (*atEnd is set). The scan stops there.
+ * @return the slot number
+ */
+int _free_slot(uint32_t idxCluster, bool * atEnd) {
+    const int numDirEntPerClus = _status.BytesPerCluster / sizeof(dirEnt);
+    dirEnt * clusBuf = malloc(_status.BytesPerCluster);
+    int numExt = 0;
+    extent * ext = _get_extents(idxCluster, 0, &numExt);
+    int slot = 0, e;
+    *atEnd = true; // a chain full of live entries ends the dir as well
+    for(e = 0; e < numExt; e++) {
+        uint32_t c;
+        for(c = 0; c < ext[e].count; c++) {
+            _dev_read(clusBuf, _status.BytesPerCluster, _clusterPos(ext[e].start + c));
+            STAT_ADD(dirClusScanned, 1);
+            int j;
+            for(j = 0; j < numDirEntPerClus; j++, slot++) {
+                if(clusBuf[j].dir_name[0] == '\0' || clusBuf[j].dir_name[0] == 0xE5) {
+                    *atEnd = clusBuf[j].dir_name[0] == '\0';
+                    goto found;
+                }
+            }
+        }
+    }
+found:
+    free(ext);
+    free(clusBuf);
+    return slot;
+}
+
+/**
+ * @brief convert FAT dir_name @FATname to a C string like "NAME.EXT" and write it to @filename
+ * @param filename: at least 13 chars
+ */
+void _FAT2flnm(const uint8_t *FATname, char *filename) {
+    int i, k = 0;
+    for(i = 0; i < 8 && FATname[i] != 0x20; i++) filename[k++] = FATname[i];
+    if(FATname[8] != 0x20) {
+        filename[k++] = '.';
+        for(i = 8; i < 11 && FATname[i] != 0x20; i++) filename[k++] = FATname[i];
+    }
+    filename[k] = '\0';
+}
+
+/**
+ * get the live entries (no '.', '..', deleted slots, long names or volume labels)
+ * of the dir whose clusters are the runs @ext[0 .. @numExt - 1]
+ * if @slotPos is not NULL, *slotPos receives a newly allocated array with the device
+ * position of every returned entry
+ * only positioned reads are used, so this is safe to call from several threads
+ * @return newly allocated array, *n receives its length. Users are responsible to free it.
+ */
+dirEnt * _read_dir_extents(const extent * ext, int numExt, int * n, off_t ** slotPos) {
+    const int numDirEntPerClus = _status.BytesPerCluster / sizeof(dirEnt);
+    dirEnt * clusBuf = malloc(_status.BytesPerCluster);
+    int vol = numDirEntPerClus;
+    dirEnt * res = malloc(vol * sizeof(dirEnt));
+    off_t * pos = slotPos ? malloc(vol * sizeof(off_t)) : NULL;
+    bool endDetected = false;
+    int e;
+    *n = 0;
+    for(e = 0; e < numExt && !endDetected; e++) {
+        uint32_t c;
+        for(c = 0; c < ext[e].count && !endDetected; c++) {
+            off_t clusPos = _clusterPos(ext[e].start + c);
+            _dev_read(clusBuf, _status.BytesPerCluster, clusPos);
+            STAT_ADD(dirClusScanned, 1);
+            int j;
+            for(j = 0; j < numDirEntPerClus; j++) {
+                if(clusBuf[j].dir_name[0] == '\0') {
+                    endDetected = true;
+                    break;
+                }
+                if(clusBuf[j].dir_name[0] == 0xE5 || clusBuf[j].dir_name[0] == '.'
+                   || (clusBuf[j].dir_attr & 0x0F) == 0x0F || (clusBuf[j].dir_attr & 0x08))
+                    continue;
+                if(*n == vol) {
+                    vol *= 2;
+                    res = realloc(res, vol * sizeof(dirEnt));
+                    if(pos) pos = realloc(pos, vol * sizeof(off_t));
+                }
+                if(pos) pos[*n] = clusPos + j * sizeof(dirEnt);
+                res[(*n)++] = clusBuf[j];
+            }
+        }
+    }
+    free(clusBuf);
+    if(slotPos) *slotPos = pos;
+    return res;
+}
+
+/**
+ * get the live entries of the dir whose first cluster is @idxCluster
+ * @return newly allocated array, *n receives its length. Users are responsible to free it.
+ */
+dirEnt * _read_dir_clus(uint32_t idxCluster, int * n) {
+    int numExt = 0;
+    extent * ext = _get_extents(idxCluster, 0, &numExt);
+    dirEnt * res = _read_dir_extents(ext, numExt, n, NULL);
+    free(ext);
+    return res;
+}
+
+/**
+ * give the file of @fd, which has no cluster yet, its clusters: one contiguous run large
+ * enough for the delayed data and for @reserve bytes if there is one, otherwise a chain
+ * built a cluster at a time for the delayed data only. The delayed data is written and
+ * the entry (in memory) is pointed at the chain, which becomes the cached chain of @fd.
+ * @return 0 if succeed, 1 if the volume has no room
+ */
+int _place_fd(int fd, uint64_t reserve) {
+    openFile * of = _status.fdTable[fd];
+    fileState * fs = &of->st;
+    dirEnt * ent = &of->ent;
+    uint64_t bytes = reserve > fs->bufLen ? reserve : fs->bufLen;
+    uint32_t numClus = (bytes + _status.BytesPerCluster - 1) / _status.BytesPerCluster;
+    uint32_t dataClus = (fs->bufLen + _status.BytesPerCluster - 1) / _status.BytesPerCluster;
+    if(numClus == 0) numClus = 1;
+    uint32_t start = _findFreeRun(numClus);
+    if(start != 0) {
+        if(fs->bufLen > 0 && _dev_write(fs->buf, fs->bufLen, _clusterPos(start)) != fs->bufLen) return 1;
+        _setFATchain(start, numClus);
+        fs->chainLen = numClus;
+        fs->lastClus = start + numClus - 1;
+        fs->tailIdx = dataClus ? dataClus - 1 : 0;
+        fs->tailClus = start + fs->tailIdx;
+        fs->preallocated = numClus > dataClus;
+    } else {
+        start = _allocClus(of->parentClus);
+        if(start == 0) return 1;
+        _setFATvalue(start, 0x0FFFFFFF);
+        if(fs->bufLen > 0 && _OS_write_file(start, fs->buf, fs->bufLen, 0) != fs->bufLen) {
+            _remove_link(start);
+            return 1;
+        }
+        fs->chainLen = 0;
+    }
+    ent->dir_fstClusLO = start & 0xFFFF;
+    ent->dir_fstClusHI = start >> 16;
+    of->nextClus = _status.openByClus[start % OPEN_BUCKETS];
+    _status.openByClus[start % OPEN_BUCKETS] = of;
+    return 0;
+}
+
+/**
+ * write the buffered data of @fd. A file with no cluster yet (delayed allocation) gets
+ * its clusters from _place_fd. The entry with the new size is then written to the list
+ * of the parent dir.
+ * @return 0 if succeed (or nothing was buffered), 1 if the data could not be written
+ */
+int _flush_fd(int fd) {
+    fileState * fs = &_status.fdTable[fd]->st;
+    dirEnt * ent = &_status.fdTable[fd]->ent;
+    uint32_t clus = ent->dir_fstClusLO + ((uint32_t)ent->dir_fstClusHI << 16);
+    if(fs->bufLen == 0 && (clus != 0 || fs->buf == NULL)) return 0;
+
+    if(clus != 0) {
+        if(_write_fd(fd, fs->buf, fs->bufLen, fs->bufOff)) return 1;
+    } else if(fs->bufLen > 0) {
+        if(_place_fd(fd, 0)) return 1;
+    }
+    _update_open(_status.fdTable[fd]);
+    fs->diskSize = ent->dir_fileSize;
+    fs->bufOff = 0;
+    fs->bufLen = 0;
+    // keep a buffer of the normal size for the next writes
+    if(fs->bufVol > WRITEBUF_CLUS * _status.BytesPerCluster) {
+        free(fs->buf);
+        fs->buf = NULL;
+        fs->bufVol = 0;
+    }
+    return 0;
+}
+
+/**
+ * write the buffered and delayed data of every open fd with the sizes of their entries, for
+ * callers that read files from the device instead of through their fds
+ * @return 0 if succeed, 1 if the data of some fd could not be written
+ */
+int _flush_open() {
+    int fd, err = 0;
+    for(fd = 0; fd < _status.fdCap; fd++) {
+        if(_status.fdTable[fd] != NULL) err |= _flush_fd(fd);
+    }
+    return err;
+}
+
+/// write the buffered data of every open fd and give back its preallocated clusters, for
+/// programs that exit with files still open
+void _flush_all() {
+    if(!_status.initialized) return;
+    _flush_open();
+    int fd;
+    for(fd = 0; fd < _status.fdCap; fd++) {
+        if(_status.fdTable[fd] != NULL) _chain_trim(fd);
+    }
+}
+
+/// cluster number @idx of the chain of @fd, walking from the cached tail when possible
+static uint32_t _chain_nth(int fd, uint32_t idx) {
+    fileState * fs = &_status.fdTable[fd]->st;
+    dirEnt * ent = &_status.fdTable[fd]->ent;
+    uint32_t cur = ent->dir_fstClusLO + ((uint32_t)ent->dir_fstClusHI << 16), k = 0;
+    if(fs->chainLen && fs->tailIdx <= idx) {
+        cur = fs->tailClus;
+        k = fs->tailIdx;
+    }
+    for( ; k < idx; k++) cur = _getFATvalue(cur);
+    return cur;
+}
+
+/**
+ * write @len bytes of @buf at @offset of the file of @fd, which has clusters.
+ * once the chain of the fd is known (_chain_load), the chain is grown ahead of the data
+ * and the walk starts at the cached tail cluster when the data lies past it
+ * @return 0 if succeed, 1 if fail
+ */
+int _write_fd(int fd, const void * buf, size_t len, off_t offset) {
+    fileState * fs = &_status.fdTable[fd]->st;
+    dirEnt * ent = &_status.fdTable[fd]->ent;
+    uint32_t startClus = ent->dir_fstClusLO + ((uint32_t)ent->dir_fstClusHI << 16);
+    uint32_t endClus = 0;
+    off_t base = 0;
+    if(len == 0) return 0;
+    if(fs->chainLen) {
+        _chain_reserve(fd, offset + len);
+        if(offset / _status.BytesPerCluster >= fs->tailIdx) {
+            startClus = fs->tailClus;
+            base = (off_t)fs->tailIdx * _status.BytesPerCluster;
+        }
+    }
+    if(_write_chain(startClus, buf, len, offset - base, &endClus) != (ssize_t)len) {
+        // give back what was reserved past the data, the chain may have grown part of the way
+        if(fs->chainLen) {
+            fs->preallocated = true;
+            _chain_trim(fd);
+        }
+        fs->chainLen = 0;
+        return 1;
+    }
+    if(fs->chainLen) {
+        uint32_t endIdx = (offset + len - 1) / _status.BytesPerCluster;
+        if(endIdx >= fs->chainLen) { // no preallocation, the write grew the chain itself
+            fs->chainLen = endIdx + 1;
+            fs->lastClus = endClus;
+        }
+        fs->tailClus = endClus;
+        fs->tailIdx = endIdx;
+    }
+    return 0;
+}
+
+/**
+ * walk the chain of @fd once and cache its last cluster and length, so appends do not
+ * walk it again. Nothing is done for a file with no cluster or a chain already known.
+ */
+void _chain_load(int fd) {
+    fileState * fs = &_status.fdTable[fd]->st;
+    dirEnt * ent = &_status.fdTable[fd]->ent;
+    uint32_t clus = ent->dir_fstClusLO + ((uint32_t)ent->dir_fstClusHI << 16);
+    if(clus == 0 || fs->chainLen) return;
+    int n = 0;
+    extent * ext = _get_extents(clus, 0, &n);
+    int i;
+    for(i = 0; i < n; i++) fs->chainLen += ext[i].count;
+    if(n > 0) fs->lastClus = ext[n - 1].start + ext[n - 1].count - 1;
+    fs->tailClus = fs->lastClus;
+    fs->tailIdx = fs->chainLen - 1;
+    free(ext);
+}
+
+/**
+ * make the chain of @fd long enough for @end bytes. It grows geometrically: by at least
+ * its current length (up to PREALLOC_MAX_CLUS), taken as one free run and linked with one
+ * FAT pass, so a file appended to in small steps ends up in few runs. The clusters past
+ * the data are given back by _chain_trim. If no run is free, nothing is done and the
+ * write grows the chain a cluster at a time.
+ * Until the trim, the chain on the device is longer than the size of the entry. After a
+ * crash OS_fsck reports this as a size mismatch and its repair cuts the chain back.
+ */
+void _chain_reserve(int fd, uint64_t end) {
+    fileState * fs = &_status.fdTable[fd]->st;
+    uint32_t need = (end + _status.BytesPerCluster - 1) / _status.BytesPerCluster;
+    if(fs->chainLen == 0 || need <= fs->chainLen) return;
+    uint32_t grow = fs->chainLen < PREALLOC_MAX_CLUS ? fs->chainLen : PREALLOC_MAX_CLUS;
+    if(grow < need - fs->chainLen) grow = need - fs->chainLen;
+    uint32_t run = _findFreeRun(grow);
+    if(run == 0) {
+        grow = need - fs->chainLen;
+        run = _findFreeRun(grow);
+        if(run == 0) return;
+    }
+    // link the run first and hang it on the chain second, a crash leaves lost clusters only
+    _setFATchain(run, grow);
+    _setFATvalue(fs->lastClus, run);
+    fs->lastClus = run + grow - 1;
+    fs->chainLen += grow;
+    fs->preallocated = true;
+}
+
+/// free the clusters preallocated past the data of @fd, a file keeps at least one cluster
+void _chain_trim(int fd) {
+    fileState * fs = &_status.fdTable[fd]->st;
+    if(!fs->preallocated || fs->chainLen == 0) return;
+    uint32_t keep = (_status.fdTable[fd]->ent.dir_fileSize + _status.BytesPerCluster - 1) / _status.BytesPerCluster;
+    if(keep == 0) keep = 1;
+    if(keep < fs->chainLen) {
+        uint32_t last = _chain_nth(fd, keep - 1);
+        uint32_t next = _getFATvalue(last);
+        _setFATvalue(last, 0x0FFFFFFF);
+        _remove_link(next);
+        fs->lastClus = last;
+        fs->chainLen = keep;
+        fs->tailClus = last;
+        fs->tailIdx = keep - 1;
+    }
+    fs->preallocated = false;
+}
+
+/// bucket of the file named @name in the dir at @parentClus
+static unsigned _slot_bucket(uint32_t parentClus, const uint8_t * name) {
+    uint32_t h = 2166136261u ^ parentClus; // FNV-1a
+    int i;
+    for(i = 0; i < 11; i++) h = (h ^ name[i]) * 16777619u;
+    return h % OPEN_BUCKETS;
+}
+
+/// the open file of entry @name in the dir at @parentClus, NULL if it is not open
+openFile * _open_slot(uint32_t parentClus, const uint8_t * name) {
+    if(parentClus == 0) parentClus = _status.idxRootDirClus;
+    openFile * of = _status.openBySlot[_slot_bucket(parentClus, name)];
+    while(of != NULL && (of->parentClus != parentClus || memcmp(of->ent.dir_name, name, 11) != 0))
+        of = of->nextSlot;
+    return of;
+}
+
+/**
+ * give a new fd to the file of entry @ent in the dir at @parentClus. All fds of one file
+ * share one openFile, found by the slot of the entry (its dir and name), so a size written
+ * through one fd is seen by the others. The first cluster cannot be the key: with delayed
+ * allocation a new file has none until its data is flushed. Free fds are kept on a stack
+ * and the table doubles when none is left, so opening costs the same whatever the number
+ * of open files.
+ * @return the fd, -1 if there is no memory
+ */
+int _fd_open(const dirEnt * ent, uint32_t parentClus) {
+    if(parentClus == 0) parentClus = _status.idxRootDirClus;
+    if(_status.numFree == 0) {
+        int cap = _status.fdCap ? 2 * _status.fdCap : FD_TABLE_MIN;
+        openFile ** table = realloc(_status.fdTable, cap * sizeof(openFile *));
+        if(table == NULL) return -1;
+        _status.fdTable = table;
+        int * stack = realloc(_status.fdFree, cap * sizeof(int));
+        if(stack == NULL) return -1;
+        _status.fdFree = stack;
+        int k;
+        for(k = cap - 1; k >= _status.fdCap; k--) {
+            _status.fdTable[k] = NULL;
+            _status.fdFree[_status.numFree++] = k;
+        }
+        _status.fdCap = cap;
+    }
+    openFile * of = _open_slot(parentClus, ent->dir_name);
+    if(of == NULL) {
+        of = calloc(1, sizeof(openFile));
+        if(of == NULL) return -1;
+        of->ent = *ent;
+        of->parentClus = parentClus;
+        of->st.diskSize = ent->dir_fileSize;
+        unsigned b = _slot_bucket(parentClus, ent->dir_name);
+        of->nextSlot = _status.openBySlot[b];
+        _status.openBySlot[b] = of;
+        uint32_t clus = ent->dir_fstClusLO + ((uint32_t)ent->dir_fstClusHI << 16);
+        if(clus != 0) {
+            of->nextClus = _status.openByClus[clus % OPEN_BUCKETS];
+            _status.openByClus[clus % OPEN_BUCKETS] = of;
+        }
+    }
+    of->refs++;
+    int fd = _status.fdFree[--_status.numFree];
+    _status.fdTable[fd] = of;
+    return fd;
+}
+
+openFile * _fd_get(int fd) {
+    if(fd < 0 || fd >= _status.fdCap) return NULL;
+    return _status.fdTable[fd];
+}
+
+/// unlink @of from the chain starting at @head, following the link at offset @next
+static void _open_unlink(openFile ** head, openFile * of, size_t next) {
+    while(*head != NULL && *head != of) head = (openFile **)((char *)*head + next);
+    if(*head != NULL) *head = *(openFile **)((char *)of + next);
+}
+
+/**
+ * release @fd. The openFile goes away with its last fd, its buffers must have been
+ * flushed by then.
+ */
+void _fd_close(int fd) {
+    openFile * of = _status.fdTable[fd];
+    _status.fdTable[fd] = NULL;
+    _status.fdFree[_status.numFree++] = fd;
+    if(--of->refs > 0) return;
+    uint32_t clus = of->ent.dir_fstClusLO + ((uint32_t)of->ent.dir_fstClusHI << 16);
+    if(clus != 0) _open_unlink(&_status.openByClus[clus % OPEN_BUCKETS], of, offsetof(openFile, nextClus));
+    _open_unlink(&_status.openBySlot[_slot_bucket(of->parentClus, of->ent.dir_name)], of,
+                 offsetof(openFile, nextSlot));
+    free(of->st.buf);
+    free(of);
+}
+
+/// the open file starting at cluster @clus, NULL if it is not open
+openFile * _open_find(uint32_t clus) {
+    openFile * of = clus ? _status.openByClus[clus % OPEN_BUCKETS] : NULL;
+    while(of != NULL && of->ent.dir_fstClusLO + ((uint32_t)of->ent.dir_fstClusHI << 16) != clus)
+        of = of->nextClus;
+    return of;
+}
+
+void _open_move(uint32_t oldParent, const uint8_t * oldName, uint32_t newParent, const uint8_t * newName) {
+    if(oldParent == 0) oldParent = _status.idxRootDirClus;
+    if(newParent == 0) newParent = _status.idxRootDirClus;
+    openFile * of = _open_slot(oldParent, oldName);
+    if(of == NULL) return;
+    _open_unlink(&_status.openBySlot[_slot_bucket(oldParent, oldName)], of, offsetof(openFile, nextSlot));
+    of->parentClus = newParent;
+    of->slotPos = 0;
+    memcpy(of->ent.dir_name, newName, 11);
+    openFile ** head = &_status.openBySlot[_slot_bucket(newParent, newName)];
+    of->nextSlot = *head;
+    *head = of;
+}
+
+/**
+ * write the entry of @of back to its dir. The device position of its slot is found by name
+ * once and kept in @of, so a size update is one small write instead of a scan of the dir;
+ * the name at that position is checked first, an entry moved since then is looked up again
+ * @return 0 if success, 1 if the entry is gone
+ */
+int _update_open(openFile * of) {
+    dirEnt cur;
+    if(of->slotPos == 0 || _dev_read(&cur, sizeof(dirEnt), of->slotPos) != sizeof(dirEnt)
+       || memcmp(cur.dir_name, of->ent.dir_name, 11) != 0) {
+        of->slotPos = 0;
+        int numExt = 0, n = 0, i;
+        off_t * pos = NULL;
+        extent * ext = _get_extents(of->parentClus, 0, &numExt);
+        dirEnt * list = _read_dir_extents(ext, numExt, &n, &pos);
+        for(i = 0; i < n && of->slotPos == 0; i++) {
+            if(memcmp(list[i].dir_name, of->ent.dir_name, 11) == 0) of->slotPos = pos[i];
+        }
+        free(list);
+        free(pos);
+        free(ext);
+        if(of->slotPos == 0) return 1;
+    }
+    return _dev_write(&of->ent, sizeof(dirEnt), of->slotPos) != sizeof(dirEnt);
+}
@@ -8,6 +8,22 @@
 
 #include "fat16_32.h"
 #include "fat32api.h"
+#include <sys/types.h>
+
+/// size of each of the two buffers used when a copy cannot stay in the kernel
+#define COPY_CHUNK_SIZE (1 << 20)
+
+/// number of FAT sectors read at once when scanning the FAT for free space
+#define FAT_SCAN_SECS 64
+
+/// most runs a file is split into by OS_import when no single free run can hold it
+#define IMPORT_MAX_RUNS 16
+
+/// a run of physically contiguous clusters
+typedef struct {
+    uint32_t start; // first cluster of the run
+    uint32_t count; // number of clusters in the run
+} extent;
 
 
 /// convert a dirEnt @p into a dirEnt for the root directory
@@ -22,8 +38,9 @@ dirEnt * _OS_getEnt(const char * path);
  offset: where reading begins (in bytes)
  length: how long is the buffer (in bytes)
  buffer: where the content is stored
+ return @length if succeed, -1 if the chain ends first
  */
-int _OS_read_file(unsigned int idxCluster, int offset, int length, void * buffer);
+ssize_t _OS_read_file(uint32_t idxCluster, off_t offset, size_t length, void * buffer);
 
 /** get the path of the parent dir of this file/dir
  return a pointer to a newly allocated string if succeed. Users are responsible to free it.
@@ -39,13 +56,28 @@ char * _get_parent_path(const char *path, char * filename);
  @buf: pointer to memory block
  @nbytes: bytes to be written
  @offset: where to start writing */
-int _OS_write_file(unsigned int idxCluster, const void * buf, int nbytes, int offset);
+ssize_t _OS_write_file(uint32_t idxCluster, const void * buf, size_t nbytes, off_t offset);
+
+/// _OS_write_file, *@lastClus (if not NULL) receives the cluster holding the last byte written
+ssize_t _write_chain(uint32_t idxCluster, const void * buf, size_t nbytes, off_t offset, uint32_t * lastClus);
 
 
 int flnm2FAT(const char * filename, unsigned char *FATname);
 
+/// verify that a C string filename equals to a FAT filename, 0 if the same
+int verify(const uint8_t *FATname, char *filename);
+
 unsigned int _findFirstEmptyClus();
 
+/// find the first free cluster at or after @goal (wrapping around), 0 if there is none
+uint32_t _findEmptyClusNear(uint32_t goal);
+
+/// first cluster of the part of the volume with the most free clusters
+uint32_t _spreadGoal();
+
+/// find a free cluster for new data, near @goal if the mount places by locality
+uint32_t _allocClus(uint32_t goal);
+
 int _setFATvalue(uint32_t idx, uint32_t value);
 
 
@@ -64,4 +96,119 @@ delete the entry with name @name from the list of dir @path
 return 0 if succeed, 1 if fail
 */
 int _delete_dirEnt(const char *path, const uint8_t name[]);
+
+/// read @n bytes at device position @pos, return the number of bytes read
+ssize_t _dev_read(void * buf, size_t n, off_t pos);
+
+/// write @n bytes at device position @pos, return the number of bytes written
+ssize_t _dev_write(const void * buf, size_t n, off_t pos);
+
+/// byte position of cluster @idxCluster on the device
+off_t _clusterPos(uint32_t idxCluster);
+
+/// get the value of FAT entry @idx in the first FAT
+uint32_t _getFATvalue(uint32_t idx);
+
+/**
+ split the chain starting at @idxCluster into runs of contiguous clusters
+ visit at most @maxClus clusters, 0 for the whole chain
+ @return newly allocated array, *n receives its length. Users are responsible to free it.
+ */
+extent * _get_extents(uint32_t idxCluster, uint32_t maxClus, int * n);
+
+/// copy @len bytes from device position @pos to host file @out_fd, return bytes copied
+size_t _copy_dev_to_fd(int out_fd, off_t pos, size_t len);
+
+/// find @count contiguous free clusters, return the first one, 0 if there is no such run
+uint32_t _findFreeRun(uint32_t count);
+
+/// find at most @maxRuns free runs holding @count clusters together, return their number, 0 if fail
+int _findFreeRuns(uint32_t count, extent * runs, int maxRuns);
+
+/// link the clusters @start .. @start + @count - 1 into one chain in all FATs
+int _setFATchain(uint32_t start, uint32_t count);
+
+/// free every cluster of the runs @ext[0 .. @n - 1] in all FATs, writing each FAT sector once; @ext is sorted
+int _free_extents(extent * ext, int n);
+
+/**
+ add the entry @ent to the list of dir @path, reusing a deleted slot if there is one
+ return 0 if succeed, 1 if fail
+ */
+int _add_dirEnt(const char *path, const dirEnt * ent);
+
+/**
+ find the slot for a new entry in the dir starting at cluster @idxCluster: the first deleted
+ slot, otherwise the end marker, in which case *atEnd is set and the marker has to move one
+ slot further. Only the clusters up to that slot are read.
+ return the slot number
+ */
+int _free_slot(uint32_t idxCluster, bool * atEnd);
+
+/// convert a FAT dir_name to a C string "NAME.EXT", @filename must hold 13 chars
+void _FAT2flnm(const uint8_t *FATname, char *filename);
+
+/**
+ get the live entries of the dir starting at cluster @idxCluster, without '.' and '..'
+ return a newly allocated array, *n receives its length. Users are responsible to free it.
+ */
+dirEnt * _read_dir_clus(uint32_t idxCluster, int * n);
+
+/**
+ get the live entries of the dir made of the runs @ext[0 .. @numExt - 1]
+ if @slotPos is not NULL it receives a newly allocated array with the device position of every entry
+ */
+dirEnt * _read_dir_extents(const extent * ext, int numExt, int * n, off_t ** slotPos);
+
+/**
+ allocate clusters for the delayed data of @fd, write it and update its entry
+ return 0 if succeed, 1 if fail
+ */
+int _flush_fd(int fd);
+
+/// _flush_fd every open fd, 0 if succeed, 1 if some data could not be written
+int _flush_open();
+
+/// _flush_fd and _chain_trim every open fd
+void _flush_all();
+
+/// write @len bytes at @offset of the file of @fd, which has clusters, 0 if succeed
+int _write_fd(int fd, const void * buf, size_t len, off_t offset);
+
+/// allocate the clusters of the file of @fd for its delayed data and @reserve bytes, 0 if succeed
+int _place_fd(int fd, uint64_t reserve);
+
+/// cache the last cluster and the length of the chain of @fd
+void _chain_load(int fd);
+
+/// grow the chain of @fd geometrically so it holds at least @end bytes
+void _chain_reserve(int fd, uint64_t end);
+
+/// free the clusters preallocated past the end of the data of @fd
+void _chain_trim(int fd);
+
+/// pick the hot paths compiled for the geometry of the mounted volume, false if the generic ones are used
+bool _geom_select();
+
+/// a new fd for the file of @ent in the dir at @parentClus, sharing the openFile of its other fds, -1 if fail
+int _fd_open(const dirEnt * ent, uint32_t parentClus);
+
+/// the open file of @fd, NULL if @fd is not open
+openFile * _fd_get(int fd);
+
+/// release @fd, and its openFile with the last fd
+void _fd_close(int fd);
+
+/// the open file starting at cluster @clus, NULL if there is none
+openFile * _open_find(uint32_t clus);
+
+/// the open file of entry @name in the dir at @parentClus, NULL if there is none
+openFile * _open_slot(uint32_t parentClus, const uint8_t * name);
+
+/// write the entry of @of back to its slot in the dir, 0 if success, 1 if the entry is gone
+int _update_open(openFile * of);
+
+/// after a rename, the open file of entry @oldName in the dir at @oldParent follows it to @newName in @newParent
+void _open_move(uint32_t oldParent, const uint8_t * oldName, uint32_t newParent, const uint8_t * newName);
+
 #endif